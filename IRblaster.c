@@ -1,7 +1,7 @@
 /*
  AVR IR Blaster. Infrared Remote Control Translater and Blaster.
- This code uses the AVR Atmega48PA microcontroller.
- It has 4096 Bytes of flash, 512Bytes of RAM, 256Bytes of eeprom.
+ This code uses the AVR Atmega48PA microcontroller, or the Atmega168 or Atmega328P with more features (MCU_TARGET in the Makefile).
+ It has 4096 Bytes of flash, 512Bytes of RAM, 256Bytes of eeprom. The Atmega328P has 32768, 2048 and 1024.
  The SFH5110 IR receiver is not working below 4V !! so we use 5V Supply, maybe 4.3V Lion accu may work.
 Remote controls usual sleep current is around 1 uA .!
 
@@ -9,178 +9,202 @@ Programing instructions see "learncode".
 
  Also contained is a working write flash routine.
 Flash programming:
-In ATmega 48/48PA there is no Read-While-Write support, and no separate Boot Loader Section. The SPM
-instruction can be executed from the entire Flash.
-This means that the CPU is halted while the flash programming takes place, which is fine.
-Here the SPM instruction performs a complex flash programming algorithm and while doing so it disconnects the clock to the CPU
-which is then halted. (to not access the flash meanwhile!)
+In ATmega 48/48PA there is no Boot Loader Section, the SPM instruction can be executed from the entire Flash
+and the CPU is halted while the flash programming takes place.
+In ATmega 168/328P the SPM instruction works only from the Boot Loader Section (see BOOTSPM in hal_avr.c),
+the code table is in the Read-While-Write section with the code, which is not readable while a page of it is written.
+So the page routine waits in the boot section with interrupts disabled until the flash programming is done, which is fine.
 
  Copyright Thomas Krueger, Hofgeismar, Germany
  December 2019
  */
 
-#include <io.h>
-#include <wdt.h>
-#include <sleep.h>
-#include <interrupt.h>
-#include <stdlib.h>
-#include <eeprom.h>
-#include <avr/boot.h>
-#include <avr/pgmspace.h>
-#include <stdio.h>
-#include <string.h>
+#include "IRblaster.h"
 
 
-// ++++++++++++++++++++++++ DEFINES +++++++++++++++++++++++++++++++++++
-#define BYTE unsigned char
-#define WORD unsigned short
-#define ULONG unsigned long
-
-// Macros: Bit operations on byte/word/long variables. Format: bset(Bit,variable). works also on SFRs(creates sbi,cbi)
-#define bset(x,y) (y |= (1 << x))
-#define bclr(x,y) (y &= (~(1 << x)))
-#define btst(x,y) (y & (1 << x))
-
-//SPM_PAGESIZE the processors pagesize is defined in iom48pa.h, the processor file. 64Bytes
-#define MINPAGE 42   //0xA80 startpage of ircode-table in flash after code, check that out !!!
-#define MAXPAGE 63   // 0xFC0 start of last page in flash
-
-
-//#define DBPRINT   // to get debug of frames on serial. saves a lot of space if off!!
+#ifdef PROFILE
+struct prf Prf[PRF_N];
+BYTE Prfcmd;
+#endif
+#ifdef PROVISION
+BYTE Prov; // flag, the table is being uploaded
+BYTE Pvpos; // Bytes of the request received, 0 = waiting for PV_SYNC
+BYTE Pvcmd;
+BYTE Pvpage;
+WORD Pvcrc;
+BYTE Pvready; // the request is complete, for pvserve()
+BYTE Pvawake; // UI ticks left without power-down, see pvserve()
+#endif
 #ifdef DBPRINT
-char sbuf[80];
-void printdb(void);
-void putcc(char c);
-void putss(char *ps);
-char getcc(void);
-#endif
-
-//protos:
-void flash_read_page (uint32_t page, uint8_t *buf);
-void flash_write_page (uint32_t page, uint8_t *buf);
-void set_receiver(void);
-void set_transmitter(void);
-BYTE decodebuf(void);
-void setuptxbuf(void);
-BYTE findcode( void);
-BYTE learncode(void);
-void blink(BYTE cnt);
-void wait(void);
-void waitlong(void);
-
-
-#define IOSIZE 70
-BYTE iobuf[IOSIZE]; // used for Rx and Tx
+BYTE Trbuf[TRSIZE]; // the trace ring, see trbegin()
+BYTE Trhead;
+BYTE Trtail;
+BYTE Trlost; // records dropped since the last one written
+BYTE Trsum;
+BYTE Trraw[IOSIZE]; // the durations of a frame, see trframe()
+BYTE Trslot; // receive slot+1 of the frame whose durations are in Trraw, 0 = free
+#endif
+
+struct rxframe Rxq[RXSLOTS]; // receive queue of frames decoded while captured, see doframe()
+struct rxframe *Rx; // slot the capture isr decodes into
+BYTE Rxhead; // index of the slot being captured
+BYTE Rxtail; // index of the oldest queued frame
+BYTE Rxframes; // number of queued frames
+BYTE Txbusy; // flag, if set, the transmitter is sending a record (or waiting in the gap before it)
+BYTE Txcnt; // index of the next duration of the record to transmit
+BYTE Txon; // flag, set while a record is sent, our own echo on the receiver is discarded
+BYTE Txdur[TXDUR]; // periods of the record in 40us units as in the table: TX_SYNC1..TX_STOP, or the symbols of a waveform. see setuptx()
+ULONG Txsend; // sendcode of the record
+ULONG Txcode; // its Bits not sent yet
+BYTE Txend; // index of the stoplen, after the Bits
+BYTE Txone; // the Bit being sent is a 1
+BYTE Txgap; // ms pause before each send of the record, 0 = 65ms. see txgap()
+BYTE Txwait; // ms of the pause left after the current Timer1 period
+BYTE Txrepeat; // the record is sent 1+Txrepeat times
+BYTE Txrep; // sends left after the current one
+#ifdef WAVEFORM
+BYTE Txraw; // durations of the waveform record being sent, 0 = pulse distance record. see rawsetup()
+BYTE Rawbits; // Bits per symbol index
+BYTE Rawsym; // symbols, in Txdur while sending
+SLOT Rawdata; // first data slot
+BYTE Rawpos; // next data Byte to read
+BYTE Rawleft; // durations left
+BYTE Rawbyte; // the indices of the data Byte read last
+BYTE Rawhave; // Bits left in Rawbyte
+BYTE Rawon; // flag, learnmode: the capture isr records the frame as waveform into Rawbuf, see rawstep()
+BYTE Rawn; // durations captured, RAWBAD if the frame does not fit
+BYTE Rawq; // receive slot+1 of the frame whose waveform is in Rawbuf, 0 = none
+#endif
 BYTE flashbuf[SPM_PAGESIZE]; // used for flash io
 WORD Lastcap;
 BYTE Capcnt=0;
 BYTE Errors=0;
-BYTE Learnbut=0; // flag, if set, we pressed the "learnbutton"
+BYTE Noise; // flag, a burst of noise is being ignored until it is silent, see noise()
+WORD Rejects[NZ_N]; // rejected bursts of noise by reason
+BYTE Learnbut=0; // presses of the "learnbutton", if set we are in learnmode
 BYTE Gotcode=0; // flag, if set, we received a valid ir code in CS.
+BYTE Learnstate; // state of the learn menu, LS_MENU.. see learncode()
+BYTE Menue; // selected menu item
+BYTE Nchain; // codes D entered
+ULONG CodeS; // the code S
+struct irrec Chain[3]; // staged records, committed by storechain() when all codes are entered
+BYTE Blinks; // LED pattern: number of blinks, 0 = none. see ui_blink()
+BYTE Blinkrep; // flag, repeat the pattern
+BYTE Blinkph; // phases (on, off) of the pattern left
+BYTE Uitime; // ticks left in the current phase
+BYTE Butcnt; // debounce ticks left, 0 = button idle (INT1 armed)
+BYTE Butlevel; // last sampled button level, 1 = pressed
+BYTE Butdown; // debounced button level
 BYTE Page; // flashpage of data in flashbuf, set by findcode()
+SLOT Rec; // table index (slot) of the record in Tr, set by findcode()
+SLOT Head; // next free slot of the log, see findlog()
+BYTE Tail; // oldest page of the log, 0..LOGPAGES-1
+SLOT Live; // live records in the log, the others are superseded or deleted
+BYTE Rawrecs; // live waveform records in the log, see reserve()
+BYTE Job; // background table job, JOB_ERASE or JOB_COMPACT, see jobstep()
+BYTE Jobpage; // next page of the job
+WORD Jobent; // directory entries the erase job has still to clear
+WORD Dirhome; // home entry of the code of dirkey()
 BYTE Debug; // if set, toggles the LED each time a vilad code is received.
-
-// SPM_PAGESIZE must be divisable by the size of this struct!
-struct ircode
-{
-    ULONG comparecode; // the code we received from remote control or 0xffffffff as end of table. Or 0 for invalid/followon code,
-    ULONG sendcode;  // the code we send out as translation, the spec follows below
-    BYTE sync1;		// synclength1. we always assume to have sync1 and sync2
-    BYTE sync2;		// synclength2
-    BYTE stoplen; // if 0, no stoplen
-    BYTE timshort; //puls duration 0 Bit. timshort + timshort = 0
-    BYTE timlong;  //puls duration 1 Bit. timshort + timlong = 1
-    BYTE coding;   //1Bit-coding scheme: 0=short/long;1=long/short
-    BYTE bits; // number of Bits in code to transmit
-    BYTE next; // followon code. if 0xAA, then the next record in the table will be send also.(fe. to power multible devices on/off).
-} CS, *PCS; // PCS global pointer to current record in flashbuf, set by findcode(). CS is used for reception.
+struct ircode CS, *PCS; // PCS global pointer to current record (Tr or a cache entry), set by findcode(). CS is used for reception.
+struct ircode Tr; // record of the table found by findcode(), expanded with its timing
+struct irtiming Timings[TIMINGS]; // timing dictionary of the table, copy of the header page
+#if defined(CACHE) || defined(WAVEFORM)
+struct ircode Cache[CACHESIZE]; // hot translation cache, see findcache(). Rawbuf in learnmode
+#endif
+#ifdef CACHE
+BYTE Cachenext; // next cache entry to replace
+#endif
+#ifdef RXPROF
+struct rxprof Prof[NPROF]; // receive profiles of the remotes in the table, see endprofile()
+BYTE Profnext; // next profile to replace
+#endif
+BYTE Repsync1; // sync of the frame of the last translation, for its repeat frames. 0 = no repeat possible
+BYTE Repsync2;
 
 
+#ifndef HOSTED // the hosted build is driven by the simulator in host/
 int main(void)
 {
 
     // INIT:
-
-    // After Reset, all port-pins are input/tri-state. Output Data is all 0. watchdog is disabled.
-    // To enable pullup of an input, write 1 to port-data register-bit.
-    // Port Registers B,C,D:PORTB=Data; DDRB=direction(1=output); PINB=Bittoggle on write 1.
-
-    // set 8MHz with internal RC oscillator. Note: default after Reset normally is 1Mhz!
-    CLKPR = _BV(CLKPCE); // enable clock prescale change
-    CLKPR = 0; // set 8 MHz
-
-    // status LED output on PD2
-    bset(2,DDRD);
-
-    // IR LED output on PD6
-    bset(6,DDRD);
-
-    // IR Receiver digital input on PB0
-    bclr(0,DDRB);
-    bset(0,PORTD); // enable pullup
-
-    // Learn-Button input on PD3 INT1
-    bclr(3,DDRD);
-    bset(3,PORTD); // enable pullup
-
-    // init serial:
-    UBRR0H = 0;
-    UBRR0L = 103; // 12=9600 Baud at 1mhz; 103=9600 Baud at 8mhz
-    UCSR0A = 0x02; //double speed
-    UCSR0B = 0x18; // RxTx enable
-    UCSR0C = 0x06; // 8N1
-
-
-    // TIMER 0: (8Bit)
-    /* Timer0 is the 38kHz oscillator on output OC0A Pin PD6, the transmit output to IR LED.
-    timer0 runs in CTC mode (Clear Timer on Compare) and toggle OC0A Pin.
-    Thus the value of the compare register determines the frequency of the symetric squarewave output.
-    Note: the CTC togglepin function introduces another divide by 2. So the formular for the comparevalue is:
-    Fcpu/(divider*frequency*2) or (8Mhz/(1*38000*2)
-    The oscillator is outputed on Pin PD6 only, if COM0A0 in TCCR0A is set to 1, else it is isolated from PD6
-    and the general portpin output data is active (see below, its 0).
-    So: COM0A0 1 = Mark(38khz), COM0A0 = 0, Space (0)
-    */
-    TCCR0A = 0x02; // CTC-mode
-    TCCR0B = 0x01; // clocksource = systemclock
-    OCR0A = 106;  // set output compare register to desired frequency!!! 8Mhz/(1*2*38000)=105.
-
-    bset(6,DDRD); // set portpin pd6 to output. Thats the OC0A frequency 38KHZ. control with COM0A0 in TCCR0A
-    bclr(6,PORTD); // clear output for Spacelevel 0 = LED off.
+    hal_init(); // ports, uart, Timer0 38khz, Timer2 timeout, learnbutton INT1
+    checkdir(); // hashed directory of the code table in eeprom
+    loadprofiles(); // frame profiles for the early end of frame
 
     // TIMER1: (16Bit)
     set_receiver();
 
-    //Timer2(8Bit) Timeout generator for receive.
-    TCCR2A = 0; // normal up counter
-    TCCR2B = 0x07; // input clock is 8Mhz/1024. 128ns/tick. 7812 Hz. times out after 32ms at count 255.
-
-    // learncode-button input INT1 enable
-    EICRA=0x08; // falling edge
-    bset(INT1,EIMSK);
-
-
-    // power down not needed peripherals. disable on debugprint!
-    //PRR = 0x87; // disable twi, SPI,UART,ADC
-
     sei(); // enable interrupts
 
-    //set_sleep_mode( _BV(SM0) | _BV(SM1) ); // power save sleep mode(SM1 +SM0), just SM1 = powerdown.
-
-    // set the sleep enable bit in SMCR. sleep mode is IDLE by default SMCR setting.
+    // set the sleep enable bit in SMCR. the sleep mode is chosen before each sleep, see deepsleep()
 	// powerconsumption@8Mhz: ON=13mA; IDLE=8.5mA; PowerSave/PowerDown=1.8mA (only IR Receiver draws current!)
     sleep_enable();
 
     while(1)
     {
-        // keep entering sleep mode
-        sleep_cpu(); // execute the sleep instruction and goto IDLE sleep
+        // keep entering sleep mode, not while a table job is pending or work came in after service() looked:
+        // a frame queued by the timeout isr (unless it waits for the transmitter, its end wakes us), a request
+        cli();
+        if (Job || (Rxframes && !Txbusy)) sei();
+#ifdef PROVISION
+        else if (Pvready) sei();
+#endif
+        else hal_sleep(deepsleep()); // IDLE, or power-down if nothing needs the timers
 
-        // an interrupt occured : T1capture or button int1
+        // an interrupt occured : T1capture, pin change, UI tick or button int1
         //This is the only code that does not execute in interrupt!
-        if (Learnbut) learncode();
-        Learnbut=0;
+        service();
+    }
+}
+#endif
+
+/* power-down sleep, when nothing needs the timers: no frame received or queued, transmitter off,
+no UI tick, no table job, not in learnmode. Timer1 stops in power-down: the first edge of the next frame
+wakes the cpu by pin change and is taken as its first capture (PCINT0_vect), the learn button wakes it by INT1.
+Called with interrupts disabled.
+returns 1 if the wakeup is armed, the main loop sleeps in power-down then, else in IDLE
+*/
+BYTE deepsleep(void)
+{
+    if (Capcnt || Rxframes || Txbusy || Learnbut || Job || hal_tick_running()) return 0;
+    TR(if (hal_uart_busy()) return 0); // the trace is being sent
+#ifdef PROVISION
+    if (Prov || Pvpos || Pvready) return 0; // a table upload or a request
+#endif
+    hal_wake_arm();
+    return 1;
+}
+
+/* The work of the main loop after each wakeup, not in interrupt.
+Also called by the host simulator after every interrupt.
+*/
+void service(void)
+{
+    if (Learnbut && (Learnstate == LS_MENU) && (Blinks != Learnbut)) ui_blink(Learnbut,1); // show the menu item
+#ifdef PROVISION
+    if (Pvready) pvserve(); // a request of the table protocol
+    if (Prov) return; // the table is being uploaded: no translation, no table job
+#endif
+
+    Gotcode=0;
+    while (doframe()) // decode and translate the queued frames
+    {
+        if (Learnbut && Gotcode) learncode(); // in learnmode a valid code is the next input of the learn menu
+        Gotcode=0;
+    }
+
+    if (!Rxframes && !Txbusy && !Capcnt) // idle: one page of a table job
+    {
+#ifdef COMPACT
+        if (!Job && (avail() < COMPACTAT)) Job = JOB_COMPACT;
+#endif
+        jobstep();
     }
+
+#ifdef PROFILE
+    if (Prfcmd) prf_dump();
+#endif
 }
 
 
@@ -204,8 +228,9 @@ Code packets are about 25 to 70ms long, Repeatcodes are send at about 100 to 150
 Valid frames are received if:
 - Frequency is 38Khz
 - one snyc cycle at start detected
+- sync1 at least 0.72ms (0.2ms when learning a waveform) and less than 10.2ms
 - Bit duration less than 10.2ms (We cannot detect in between sync bits which messup the reception as timing is averaged)
-- Bit duration > 0
+- Bit duration at least 0.2ms (RXMIN)
 - Puls- or Pause- Duration Modulation detected
 - min 10 Bits received
 - max 32 Bits received
@@ -213,59 +238,98 @@ Valid frames are received if:
 
 */
 
-// set timer1 to receiver mode from ICF1 pin:
+// arm the timer1 capture from ICF1 pin, capture into the next free slot of the receive queue:
+// The transmitter is not touched, it may be running.
 void set_receiver(void)
 {
-    bclr(COM0A0,TCCR0A); // turn off 38khz
-    Capcnt=Errors=0;
+    Capcnt=Errors=Noise=0;
 
-    TCCR1A = 0; // normal 16bit mode up counter.
-    TCCR1B = 0x82; // noice-canceller, falling-edge, clocksource = systemclock/8
-    TIFR1  = 0xff; // clear all int flags
-    TIMSK1 = 0x20; // enable capture interrupt
+    if (Rxframes < RXSLOTS)
+    {
+        Rx = &Rxq[Rxhead];
+        memset(Rx,0,sizeof(*Rx));
+        hal_capture_start(); // falling-edge, enable capture interrupt
+    }
+    else
+        hal_capture_stop(); // queue full, doframe() arms the receiver again when a slot is free
 
 }
 
 /* Timer1-Tx is used for transmission. playback recorded IR codes.
-It receives the duration of each pulse or pause from the recorded/constructed sample stream in iobuf.
-A stream has a maximum of 67 Byte-duration-samples. End-indicator=0 or max 67 items, ->  32 databits + syncs +stop
+Timer1 runs free at 1Mhz all the time, so the capture for the receiver stays armed while transmitting (full duplex).
+The transmitter uses the output compare A: each period is added to OCR1A, so the timing does not drift
+when the compare interrupt is delayed by a capture interrupt.
+The isr generates the durations of the record itself (see txnext): sync1, sync2, a Bit pair per Bit of the sendcode,
+the optional stoplen. Their periods are computed once per record by setuptx(), no sample stream is built.
 It is assumed, that either pulse duration or pause duration is used. ie:NEC,....others to get a hexvalue to compare with.
-The first sample defines the active sync-pulse.
-Next sample defines the following pause....and so on. The last could be a stoppulse.
-The timer1 is started in CTC mode with the first duration programmed.(in timer1 OVL-int routine)
-If timer1 reaches the duration value, a compare int is generated.
+The first duration is the active sync-pulse.
+Next defines the following pause....and so on. The last could be a stoppulse.
+The compare is started with the gap before the frame (TC_GAP of its timing, see txgap).
+For a repeat frame of a held key the gap is TXREPGAP at most: the default 65ms plus a NEC frame (67ms) is longer
+than the 108ms the repeat frames come, the transmitter would fall behind and repeats were dropped.
+If timer1 reaches the compare value, a compare int is generated.
 In its int-routine, the transmitter output is inverted (Mark/Space) and the next duration is loaded.
 */
-// set timer1 to transmitter mode and start transmission of data in iobuf.
-void set_transmitter(void)
+// start transmission of the record set up by setuptx() with timer1 compare. Call with interrupts disabled (16bit timer registers).
+// repeat: for a repeat frame, the short gap
+void set_transmitter(BYTE repeat)
 {
-    bclr(COM0A0,TCCR0A); // turn off 38khz
-    Capcnt=0;
-    TCCR1A = 0; // 16bit mode up counter, CTC.
-    TCCR1B = 0x0A; // CTC, clocksource = systemclock/8
-    TCNT1=0;
-    OCR1A=0xffff; // start Tx-cycle after 66ms on TIMER1_COMPA_vect interrupt. (actually we need 100ms between frames)
-    TIFR1  = 0xff; // clear all int flags
-    TIMSK1 = 0x02; // enable OCIE1A compare match interrupt
+    WORD gap = txgap();
+
+    hal_ir_space(); // turn off 38khz
+    Txbusy=1;
+    Txrep = Txrepeat;
+    if (repeat && (Txwait || gap > TXREPGAP*1000U))
+    {
+        Txwait = 0;
+        gap = TXREPGAP*1000U;
+    }
+    hal_compare_start(gap);
+}
+
+/* Rewind the record for its next send and return the first Timer1 period of the pause before it.
+A pause longer than a Timer1 period (65ms) is waited in periods of TXSTEP ms, Txwait counts down the rest.
+The isr adds the periods to the compare register, so the pause is exact from the end of the previous record on.
+*/
+WORD txgap(void)
+{
+    Txcnt=0;
+    Txcode = Txsend;
+    WF(if (Txraw) rawrewind()); // the indices are read from flash again
+    if (!Txgap) return 0xffff; // the default, 66ms
+    Txwait = Txgap;
+    return txwait();
 }
 
+// the next period of the pause
+WORD txwait(void)
+{
+    BYTE ms = (Txwait > TXSTEP) ? TXSTEP : Txwait;
+
+    Txwait -= ms;
+    return ms * 1000U;
+}
 
 
 
-/* when the "learnbutton" is pressed we enter here.
+
+/* learn menu, entered when the "learnbutton" is pressed.
+A state machine: service() calls it with every valid remote code (in CS) while in learnmode.
+The LED prompts are blinked by the UI tick meanwhile, see ui_blink().
 
 A remotecontrol code S1 maybe translated into 1,2 or 3 other ir codes D1,D2 or D3
 
 Menue:
 Blink 1 = learn a single code:  S1 -> D1  (update possible)
-Blink 2 = learn a 2 followon codes, like power for 2 devices: S1 ->D1 ->D2     (only append possible else error)
-Blink 3 = learn a 3 followon codes, like power for 3 devices: S1 ->D1 ->D2->D3 (only append possible else error)
+Blink 2 = learn a 2 followon codes, like power for 2 devices: S1 ->D1 ->D2     (update possible)
+Blink 3 = learn a 3 followon codes, like power for 3 devices: S1 ->D1 ->D2->D3 (update possible)
 Blink 4 = erase flashtable, press 2 different IRcodes to activate. (all codes are erased!!)
 -- set Debug LED toggle modes: (Disable by PowerOff)
 Blink 5 = LED is toggled each time a valid code was reveied. to test if IR is 38khz and receivable.
 Blink 6 = same as 5, but toggles LED only on code compare match. find same code on different controls, test code recognize.		  
 Blink 7 = toggle LED on 32bit code received. to look for modern codes like NEC!
 Blink 8 = toggle LED on 16bit code received. 
+Blink 9 = delete the translation of a single code: press the code S (blink 1)
 
 Menue selection:
 The LED will blink the number of times the "learnbutton" was pressed ie. shows menue item.
@@ -278,6 +342,7 @@ if menue 2
 - blink 3 time = prompt to press the replacementcode D2
 if menue 3
 - blink 4 time = prompt to press the replacementcode D3
+A code D the decoder cannot read (biphase, more than 32 Bits) is stored as waveform, only as the last one (WAVEFORM).
 
 on error (flash table full or entered S-code in D1 or D2 or D3)
 	- blink 10 times  return error
@@ -285,274 +350,989 @@ on error (flash table full or entered S-code in D1 or D2 or D3)
 - blink 1  = OK
 return success
 
-If you pressed the button more than 4 times just press any remote key to exit.
-DONT press remote keys too fast, this may corrupt the data entry.
+If you pressed the button more than 9 times just press any remote key to exit.
+Received frames are queued (see doframe), so remote keys may be pressed quickly, they are taken in order.
 
 This routine may NOT be called from interrupt!!
-returns: 0=OK; 1=error
 */
-BYTE learncode(void)
+void learncode(void)
 {
-    ULONG codeS;
-    BYTE i,j,menue;
+    BYTE t;
 
-    // Blink Menue. press the "learnbutton" so many times as desired menueitem. then press any key on remote.
-    Gotcode=0;
-    while (!Gotcode) blink(Learnbut>>1); // wait for a remotecode to acknowledge menue selection
-    menue=Learnbut>>1; // divide by 2, each press causes 2 triggers
-	
-//Debug functions:	
-	
-	if (menue == 5) // any valid code
-	{
-		Debug = 1;
-		goto retok;
-	}
+    switch (Learnstate)
+    {
+        case LS_MENU: // a remote key selects the menu item
+        Menue = Learnbut;
 
-	if (menue == 6) //compare match
-	{
-		Debug = 2;
-		goto retok;
-	}
-	
-	if (menue == 7) // 32bit codes
-	{
-		Debug = 3;
-		goto retok;
-	}
-	
-	if (menue == 8) //16 Bit codes
-	{
-		Debug = 4;
-		goto retok;
-	}
-	
-	if (menue > 8) goto reterr; // invalid menue item.
-	
-// Code functions:
-	
-    codeS=CS.sendcode;
-	
-	
-    if (menue==4) // erase flashtable
-    {
-		Gotcode=0;
-        while (!Gotcode) blink(4);// press different remote key as before to acknowledge erase operation.
-        if (codeS==CS.sendcode) goto reterr;; //you pressed the same key so abort.
-		cli();
-        for (i=MINPAGE; i<=MAXPAGE; i++)
+//Debug functions:
+        if ((Menue >= 5) && (Menue <= 8)) // 5=any valid code, 6=compare match, 7=32bit codes, 8=16bit codes
         {
-            boot_page_erase ((ULONG)(SPM_PAGESIZE*i)); // erase the destination page
-            boot_spm_busy_wait ();      // Wait until page is erased.
+            Debug = Menue-4;
+            goto retok;
         }
-		sei();
-        goto retok;
-    }
 
-    // enter  the remote control code S1
-    Gotcode=0;
-    while (!Gotcode) blink(1); // wait for first remotecode S
-    codeS=CS.sendcode;
-
-    for (j=0; j<menue; j++) // enterloop for replacement codes and storage
-    {
-        // enter  the replacement code  D
-        Gotcode=0;
-        while (!Gotcode) blink(j+2); // wait for replacement code D
-
-        if (codeS==CS.sendcode) goto reterr; //you entered codeS again, that makes no sense
-
-		//setup the new record
-        if (!j) CS.comparecode = codeS; // set the comparecode to S for first entry
-        else CS.comparecode = 0; // multicode indication
-		if ((menue==1)||((j+1)==menue)) CS.next=0;
-		else CS.next=0xAA; // multicode indicator
-
-        // now we have the complete translatecode in CS, lets store it in flash
+        if (Menue > 9) goto reterr; // invalid menue item.
 
+// Code functions:
+        CodeS = CS.sendcode;
+        if (Menue == 4) // erase flashtable
+        {
+            learnwait(LS_ERASE,4); // press different remote key as before to acknowledge erase operation.
+            return;
+        }
+        while (jobstep()); // finish an erase before the table is used
+        if (Menue == 9) learnwait(LS_DELETE,1); // the code S to delete
+        else learnwait(LS_S,1); // wait for first remotecode S
+        return;
+
+        case LS_ERASE:
+        if (CodeS == CS.sendcode) goto reterr; //you pressed the same key so abort.
+        starterase(); // the pages are erased in the background
+        goto retok;
 
-        // find a possible existing entry for S1 in flashpage for update or find end of table
-		switch (findcode())
-		{
-			case 0: // found existing entry of code asto CS.comparecode>0
-			if (menue>1) goto reterr; //there was an existing entry for codeS, we cannot place multicodes for this. delete table first
-			case 1: // found end of table with free space left.
-			break;
-			case 2: // the tablespace is full
-			goto reterr;
-			
-		}
+        case LS_DELETE:
+        if (findcode()) goto reterr; // not in the table
+        killrec(Rec);
+        goto retok;
 
+        case LS_S: // the remote control code S1
+        CodeS = CS.sendcode;
+        addprofile(); // frames of this remote can end early from now on
+        if (makeroom(Menue)) goto reterr; // the whole chain must fit behind Head, compaction must not split it
+        Nchain = 0;
+        learnwait(LS_D,2);
+        return;
+
+        case LS_D: // the replacement codes D, staged in RAM
+#ifdef WAVEFORM
+        if (CS.bits == BITS_RAW) // not a pulse distance code: its waveform in Rawbuf (see rawstep)
+        {
+            if (Nchain+1 < Menue) goto reterr; // only as the last code, the next frame would overwrite it
+            CS.sendcode = rawpack();
+            if (makeroom(Menue + rawslots(CS.sendcode) + RAWRESERVE - reserve())) goto reterr; // see storechain()
+            t = REC_RAW | REC_NEXT; // the data slots follow
+        }
+        else
+#endif
+        {
+            if (CodeS == CS.sendcode) goto reterr; //you entered codeS again, that makes no sense
 
-        memcpy(PCS,&CS,sizeof(struct ircode)); // copy new entry to flashbuf 
-        flash_write_page(Page,flashbuf);
+            t = findtiming(&CS); // RAM only until the commit
+            if (t >= TIMINGS) goto reterr; // no room for another timing
+        }
+        Chain[Nchain].comparecode = Nchain ? 0 : CodeS; // comparecode S for first entry, 0 = multicode indication
+        Chain[Nchain].sendcode = CS.sendcode;
+        Chain[Nchain].timing = t;
+        if (++Nchain < Menue)
+        {
+            Chain[Nchain-1].timing |= REC_NEXT; // multicode indicator
+            learnwait(LS_D,Nchain+2); // wait for the next replacement code D
+            return;
+        }
 
-    } //endfor
+        // now we have the complete chain, find a possible existing entry for S1 in the log for update
+        CS.comparecode = CodeS;
+        if (findcode() == 2) goto reterr; // the tablespace is full. 0: storechain deletes the old entry (and its chain)
+        if (storechain(Chain,Menue,(t & REC_RAW) ? Rawbuf : 0)) goto reterr; // write to flash and update the directory
+        goto retok;
+    }
 
 retok:
-    blink(1); // OK
-    return 0;
+    learnend(0); // blink 1
+    return;
 
+reterr:
+    loadtimings(); // drop the timings of a chain not committed
+    learnend(1); // blink 10
+}
 
+// wait for the next remote code in state st, prompt with cnt blinks
+void learnwait(BYTE st, BYTE cnt)
+{
+    Learnstate = st;
+    WF(Rawn = RAWBAD); // until a frame starts
+    WF(Rawon = (st == LS_D));
+    ui_blink(cnt,1);
+}
 
-reterr:
-    blink(10);
-    return 1;
+// leave learnmode, blink the result once: 1=OK, 10=error
+void learnend(BYTE err)
+{
+    Learnstate = LS_MENU;
+    Learnbut = 0; // translate again
+    WF(Rawon = 0);
+    clearcache(); // Rawbuf was used
+    ui_blink(err ? 10 : 1,0);
 }
 
 
 
-/* find translation code im memory and copy to CS .
-- compare CS.comparecode with the tableentrys-comparecode
-	- on match copy it to CS and return success
-	- if table.comparecode is 0xffffffff thats end of table, return error
-		global var "Page" is set to flashpage of data in flashbuf for possible update,
-		so we can use flashbuf to create new entry and save it under "Page".
+/* Table format:
+page MINPAGE is the header: TABMAGIC and the timing dictionary. The timing of a send code (sync1..bits of
+struct ircode) is stored there once, as most codes share the timing of a few remotes.
+pages TABPAGE..MAXPAGE hold the records (struct irrec): comparecode, sendcode and the index of the timing.
+The dictionary is kept in RAM (Timings), loaded at power on by loadtimings().
+
+The record pages are a log (ring of LOGPAGES pages), records are only appended at Head:
+written into the erased slot without erasing the page (flash_program_page).
+- an update appends the new record and then deletes the old one
+- delete: the comparecode of the record is programmed to 0 (tombstone). A record with comparecode 0
+  is a followon record of a chain, it is live only if the record before it is live and has REC_NEXT.
+  So deleting the first record of a chain deletes the whole chain.
+- a waveform record (REC_RAW) is followed by its data slots, followon records with comparecode 0 as well,
+  so they live and die with it. see struct rawhead
+- compaction (COMPACT): the live records of the oldest page (Tail) are appended again, then the page is erased.
+  It runs from the main loop when the receiver is idle and free space gets low, one page per wakeup.
+  Without it the log is not a ring: the slots of deleted records are free again only after an erase (menu 4).
+So every page is erased once per round of the log (wear leveling), and no write erases a page with live data.
+A power loss during an update or compaction leaves a duplicate, checkdir() deletes the older copy at power on.
+*/
+
+/* find translation code in the table.
+The hashed directory in eeprom (see dirfind) holds an entry per code: its slot and a fingerprint of the code.
+Only the entries from the home of the code on are read, and only the pages of entries with a matching fingerprint.
+A miss reads a few entries and mostly no flash page at all.
+- on match of the fingerprint read that page and compare CS.comparecode with the tableentrys-comparecode
+- on compare match return success
+- not found: Rec is set to Head for a possible append with storecode()
 returns: 
- - 0=OK found; flashbuf,Page and PCS valid, containing found record; record copied to CS
- - 1=not found but end of table has room for additional entry; flashbuf,Page and PCS valid, containing found record
- - 2=not found, the table is full. flashbuf,Page and PCS invalid == 0
- Page contains the flash pagenumber of last accessed page.
- flashbuf contains the pagedata of the last accessed page!
- PCS contains the "struct ircode" index of current record in flashbuf
+ - 0=OK found; Tr, Rec and PCS valid, containing found record
+ - 1=not found but the log has room for additional entry; Rec = Head
+ - 2=not found, the table is full. PCS invalid == 0
+ Rec contains the slot of the record, Page the flashpage in flashbuf.
  */
 BYTE findcode(void)
 {
-    BYTE i,flag;
-
+    Page = 0; // no page loaded yet
 
-// find code in CS in the flash table
-    flag=0;
-    for (Page=MINPAGE; Page<=MAXPAGE; Page++)
+    if (CS.comparecode && (dirfind(CS.comparecode,RECORDS) < DIRSIZE)) // comparecode 0: followon records never match
     {
-        PCS = (void*)flashbuf;
-        flash_read_page (Page, flashbuf);
-        for (i=0; i<(SPM_PAGESIZE / sizeof(struct ircode)); i++)
-        {
-            if (PCS->comparecode==0xffffffffL) 
-			{
-				return 1; // end of table found, there is room for another entry
-			}
-            if (PCS->comparecode && (PCS->comparecode == CS.comparecode)) // skip comparecode==0 
-            {
-                flag=1;
-                break; // found it
-            }
-            PCS++;
-        }
-        if (flag) break;
+        loadrec(Rec);
+        return 0;
     }
 
-    if (!flag) 
+    if (avail() <= reserve()) 
 	{
 		PCS = 0;
-		return 2; // we searched the whole table space and did not find the code or 0xffffffff, so table is full
+		return 2; // did not find the code and no free record, so table is full
 	}
 
-// PCS now points to the matching  ircode struct or next free entry
+    Rec = Head; // the next free entry
+    return 1;
+}
 
-    return 0;
+// returns the record in slot s, its page is loaded into flashbuf
+struct irrec *slotrec(SLOT s)
+{
+    if (Page != TABPAGE + s/RECPERPAGE) // not in flashbuf
+    {
+        Page = TABPAGE + s/RECPERPAGE;
+        flash_read_page (Page, flashbuf);
+    }
+    return (struct irrec*)flashbuf + s%RECPERPAGE;
 }
 
+// expand record i of the table into Tr, PCS points to it
+void loadrec(SLOT i)
+{
+    struct irrec *p = slotrec(i);
 
+    Tr.comparecode = p->comparecode;
+    Tr.sendcode = p->sendcode;
+    if (p->timing & REC_RAW) // waveform, it ends a chain. its REC_NEXT are the data slots
+    {
+        memset(&Tr.sync1,0,sizeof(struct irtiming));
+        Tr.bits = BITS_RAW;
+        Tr.next = 0;
+    }
+    else
+    {
+        memcpy(&Tr.sync1,&Timings[p->timing & REC_TIMING],sizeof(struct irtiming));
+        Tr.next = (p->timing & REC_NEXT) ? 0xAA : 0;
+    }
+    Rec = i;
+    PCS = &Tr;
+}
 
+SLOT nextslot(SLOT s)
+{
+    return (s+1 < RECORDS) ? s+1 : 0;
+}
 
-/*
-Decode the received ircode in iobuf and fill the global CS struct so we can compare it with table entrys.
-NOTE: a 1-bit can be double or trible the 0-bit length!
-Modulation may have not a 50% duty cycle, so time-values for high/low may be different!
-Most common the Puls-duration is longer asto achieve a stronger illumination ie.distance,
-but its better to increase the Pulscycle of the 38khz oscillator to get better illumination power!!
-We are workig on a 50% duty cyle so: Bittime0=(t1+t2)/2; Bittime 1=Bittime0/2 + ((t1+t2) - Bittime0/2)
-returns 0=OK;1=error
-*/
-BYTE decodebuf(void)
+// number of slots in the log from Tail to Head
+SLOT used(void)
 {
-    BYTE w1,w2;
-    ULONG l=0; // assembled code
-    BYTE i,b,flag;
-    WORD al=0; //averge short
-    WORD ah=0; //average long
-    BYTE lc=0; //average counters
-    BYTE hc=0;
-    BYTE cod0=0; // detect coding order
-    BYTE cod1=0;
-    BYTE ret=0;
-    BYTE *ps;
+    return ((WORD)Head + RECORDS - Tail*RECPERPAGE) % RECORDS; // Head never reaches the Tail page, see RESERVE
+}
 
+// free slots from Head to the Tail page
+SLOT avail(void)
+{
+    return RECORDS - used();
+}
 
-    ps=&iobuf[1]; // first sync. iobuf[0] is not used due to program flow!
-    CS.sync1=*ps++;
-    CS.sync2=*ps++;
+// free slots kept for compaction: a compaction step may have to move the rest of a waveform record
+BYTE reserve(void)
+{
+    return Rawrecs ? RAWRESERVE : RESERVE;
+}
+
+/* write the record in CS to the table, see storechain(). Rec as set by findcode().
+returns 0=OK, 1=the timing dictionary or the table is full (see makeroom)
+*/
+BYTE storecode(void)
+{
+    BYTE t = findtiming(&CS);
+    struct irrec r;
+
+    if (t >= TIMINGS) return 1; // no room for another timing
+    r.comparecode = CS.comparecode;
+    r.sendcode = CS.sendcode;
+    r.timing = t;
+    if (CS.next == 0xAA) r.timing |= REC_NEXT;
+    return storechain(&r,1,0);
+}
 
+/* commit a chain of n records, staged in RAM by learncode(): append it at Head, and delete the old record at Rec
+if findcode() found one (update). Keep the directory in eeprom in sync: the entry of the code points to the new
+chain, on an update it is the entry of the old one. The directory is invalid while it writes (see dirbegin).
+New timings of the chain (see findtiming) are written to the header page first.
+The records are written with one page write, two if the chain crosses a page boundary.
+If raw is set, the last record is a waveform (see rawpack), its data slots are written from raw behind it.
+They are followon records with REC_NEXT up to the last one.
+The last record (no REC_NEXT) is the commit marker: a chain cut by a power loss ends in REC_NEXT
+and is deleted by findlog() at power on.
+Not called from interrupt, and not while the receive isr may call findcode() (eeprom access is not reentrant).
+returns 0=OK, 1=the table is full (see makeroom) or the directory has no free entry near the home of the code
+*/
+BYTE storechain(struct irrec *r, BYTE n, BYTE *raw)
+{
+    BYTE i,m=n,magic;
+    SLOT old = Rec;
+    SLOT start = Head;
+    WORD d = DIRSIZE;
+    struct irrec *p;
+
+    if (raw) m += rawslots(r[n-1].sendcode);
+    if (avail() < (raw ? RAWRESERVE : reserve()) + m) return 1;
+    if (r->comparecode) // a followon record stored alone (sim_table_add) has no entry
+    {
+        if (old != start) d = dirfind(r->comparecode,old); // update
+        if (d >= DIRSIZE) d = dirfree(r->comparecode,DIRPROBE);
+        if (d >= DIRSIZE) return 1;
+    }
+    clearcache(); // the table changes
+    magic = dirbegin();
+    savehead();
 
-// we always skip the first two periods as being sync!!
-    for (i=3,b=0; i<IOSIZE; i+=2,b++)
+    for (i=0; i<m; i++)
     {
-        flag=0;
-        w1=*ps++; // get next 2 time value = 1 bit-cycle
-        w2=*ps++;
-		
-        // end detection by value of 0
-        if (!w1) // no stoplen
+        p = slotrec(Head);
+        if (i < n) memcpy(p,&r[i],sizeof(struct irrec));
+        else // data slot
         {
-            CS.stoplen=0;
-            break;
+            p->comparecode = 0;
+            memcpy(&p->sendcode,raw,RAWPERSLOT);
+            raw += RAWPERSLOT;
+            p->timing = (i+1 < m) ? REC_DATA|REC_NEXT : REC_DATA;
         }
-        if (!w2) // have stoplen
+        Head = nextslot(Head);
+        if ((i+1 == m) || !(Head%RECPERPAGE)) flash_program_page(Page,flashbuf); // chain complete or page full
+    }
+    dirset(d,r->comparecode,start);
+    setdirhead();
+    Live += m;
+    if (raw) Rawrecs++;
+
+    if (old != start) killrec(old); // update: the old one is deleted after the new one is written
+    hal_ee_write(EE_MAGIC, magic);
+    return 0;
+}
+
+#ifdef COMPACT
+// write record r to the slot at Head
+void append(struct irrec *r)
+{
+    memcpy(slotrec(Head),r,sizeof(struct irrec));
+    flash_program_page(Page,flashbuf); // the slot is erased, no page erase needed
+    Head = nextslot(Head);
+    setdirhead();
+}
+#endif
+
+// delete the record in slot s and the followon records of its chain, and its directory entry
+void killrec(SLOT s)
+{
+    struct irrec *p = slotrec(s);
+    ULONG code = p->comparecode;
+    SLOT h = s;
+    WORD d;
+    BYTE magic;
+
+    if (!code) return; // followon or already deleted
+    clearcache();
+    p->comparecode = 0; // tombstone: only clears bits
+    flash_program_page(Page,flashbuf);
+    Live--;
+    if (p->timing & REC_RAW) Rawrecs--;
+    while ((p->timing & REC_NEXT) && (nextslot(s) != Head)) // the chain is dead now too, with the data of a waveform
+    {
+        s = nextslot(s);
+        p = slotrec(s);
+        Live--;
+        if (p->timing & REC_RAW) Rawrecs--;
+    }
+    d = dirfind(code,h);
+    if (d < DIRSIZE) // not if an update or checkdir() took the entry for the new copy
+    {
+        magic = dirbegin();
+        dirremove(d);
+        hal_ee_write(EE_MAGIC, magic);
+    }
+}
+
+#ifdef COMPACT
+/* compaction step: append the live records of the Tail page at Head again and erase the Tail page.
+A chain that continues into the next page is moved completely, its rest in the next page
+is dead then, as it follows no live record anymore. The directory entries move with the records.
+returns 1 if a page was erased, 0 if there are no dead records in the log to gain space from
+*/
+BYTE compact(void)
+{
+    BYTE i,live,chain=0,magic;
+    SLOT n,s;
+    struct irrec r, *p;
+
+    if ((Live >= used()) || (Head/RECPERPAGE == Tail)) return 0; // nothing dead, or only the Head page in use
+    for (i=0, n=0, s=Tail*RECPERPAGE; (i<RECPERPAGE) || chain; i++, s=nextslot(s)) // the records to move
+    {
+        p = slotrec(s);
+        live = p->comparecode ? 1 : chain;
+        chain = live && (p->timing & REC_NEXT);
+        n += live;
+    }
+    if (n >= avail()) return 0; // Head would reach the Tail page: a power loss cut a step, its copies fill the reserve
+    magic = dirbegin();
+    s = Tail*RECPERPAGE;
+    for (i=0; (i<RECPERPAGE) || chain; i++, s=nextslot(s))
+    {
+        memcpy(&r,slotrec(s),sizeof(r));
+        live = r.comparecode ? 1 : chain; // a followon record lives if its chain does
+        chain = live && (r.timing & REC_NEXT);
+        if (live && r.comparecode) dirset(dirfind(r.comparecode,s),r.comparecode,Head);
+        if (live) append(&r);
+    }
+    flash_erase_page(TABPAGE+Tail);
+    Page = 0;
+    if (++Tail >= LOGPAGES) Tail=0;
+    hal_ee_write(EE_MAGIC, magic);
+    clearcache(); // the slots changed
+    return 1;
+}
+#endif
+
+/* Table jobs: work on the flash table that takes more than one page erase, done from the main loop
+one page per step with interrupts enabled between the steps, while the receiver is idle (see service).
+The main loop does not sleep while a job is pending.
+- JOB_ERASE: erase all pages, header page last. The table is empty for lookups from the start.
+  Pages already erased are skipped, on a big table mostly empty: checking one takes a fraction of an erase.
+  Then the directory, DIRCLEAR entries per step: an entry in use takes two eeprom writes (3.3ms each).
+- JOB_COMPACT: compact() until enough space is free (COMPACT).
+returns the job still pending, 0 = none
+*/
+BYTE jobstep(void)
+{
+    BYTE i;
+
+    switch (Job)
+    {
+        case JOB_ERASE:
+        if (Jobpage >= MINPAGE)
         {
-            CS.stoplen=w1;
+            while ((Jobpage > MINPAGE) && blankpage(Jobpage)) Jobpage--;
+            if (!blankpage(Jobpage)) flash_erase_page(Jobpage);
+            Page = 0; // flashbuf may hold the old page
+            Jobpage--;
             break;
         }
-		
-        if (b==32) // we are after bit32 but not end of data-> error, unsupported longer code
+        for (i=0; (i<DIRCLEAR) && Jobent; i++) dirput(--Jobent,DIREMPTY); // erased eeprom is empty
+        if (!Jobent)
         {
-            ret++;
-            break;
+            hal_ee_write(EE_PROBE, 0);
+            hal_ee_write(EE_MAGIC, DIRMAGIC); // empty directory, Head = 0
+            Job = 0;
         }
+        break;
 
+#ifdef COMPACT
+        case JOB_COMPACT:
+        if (!compact() || (avail() >= COMPACTAT)) Job = 0;
+        break;
+#endif
+    }
+    return Job;
+}
 
-        // if w1 > w2*2   or w2 > w1*2, its a 1
-        if (w1 > (w2<<1))
+/* erase the table (menu 4): empty for lookups at once, the pages are erased by JOB_ERASE.
+EE_MAGIC marks the erase in eeprom, checkdir() starts it again after a power loss.
+*/
+void starterase(void)
+{
+    hal_ee_write(EE_MAGIC, ERASEMAGIC);
+    Head = Tail = Live = Rawrecs = 0;
+    setdirhead();
+    clearcache();
+    clearprofiles();
+    memset(Timings,0xff,sizeof(Timings)); // empty dictionary
+    Job = JOB_ERASE;
+    Jobpage = MAXPAGE;
+    Jobent = DIRSIZE;
+}
+
+// compact until n records can be appended. returns 0=OK, 1=the table is full of live records
+BYTE makeroom(BYTE n)
+{
+#ifdef COMPACT
+    BYTE i;
+
+    for (i=0; (i<LOGPAGES) && (avail() < reserve()+n); i++)
+        if (!compact()) break;
+#endif
+    return avail() < reserve()+n;
+}
+
+/* find the log at power on: Head, Tail and the number of live records.
+The pages in use are a contiguous part of the ring, only the Head page can be partly written.
+Head: the first erased slot of a partly written page, else the first erased page after a page in use.
+Tail: the first page in use after Head.
+A chain at the end of the log that was not completely written is deleted.
+*/
+void findlog(void)
+{
+    BYTE i,q,live,chain=0;
+    SLOT n,s,h=0;
+    struct irrec *p;
+
+    Head = Tail = Live = Rawrecs = 0;
+    for (q=0; q<LOGPAGES; q++)
+    {
+        flash_read_page (TABPAGE+q, flashbuf);
+        p = (struct irrec*)flashbuf;
+        if (p[0].comparecode == 0xffffffffL) // erased page
         {
-            flag=1; //its a 1 bit
-            cod0++; //count coding long-short
+            if (Head) continue;
+            flash_read_page (TABPAGE + (q ? q-1 : LOGPAGES-1), flashbuf);
+            if (p[0].comparecode != 0xffffffffL) Head = q*RECPERPAGE; // the page before is in use
+            continue;
         }
-        else if (w2 > (w1<<1))
+        for (i=1; i<RECPERPAGE; i++)
+            if (p[i].comparecode == 0xffffffffL) break;
+        if (i < RECPERPAGE) Head = q*RECPERPAGE + i; // partly written
+    }
+    Page = 0;
+
+    q = Head/RECPERPAGE;
+    if (Head%RECPERPAGE) q++;
+    for (i=0; i<LOGPAGES; i++, q++) // first page in use after Head
+    {
+        if (q >= LOGPAGES) q=0;
+        if (slotrec(q*RECPERPAGE)->comparecode != 0xffffffffL) break;
+    }
+    if (i < LOGPAGES) Tail = q; // else empty
+
+    for (n=used(), s=Tail*RECPERPAGE; n; n--, s=nextslot(s))
+    {
+        p = slotrec(s);
+        live = p->comparecode ? 1 : chain;
+        chain = live && (p->timing & REC_NEXT);
+        Live += live;
+        if (live && (p->timing & REC_RAW)) Rawrecs++;
+        if (p->comparecode) h = s; // head of the current chain
+    }
+    if (chain) killrec(h); // the last chain has no commit marker, power was lost while storechain() wrote it
+}
+
+/* returns the index of the timing of record r in the dictionary, adds it if new.
+TIMINGS if it is not there and the dictionary is full.
+A new timing is only in RAM until savehead(), loadtimings() drops it.
+*/
+BYTE findtiming(struct ircode *r)
+{
+    BYTE i;
+
+    for (i=0; i<TIMINGS; i++)
+        if (!memcmp(&Timings[i],&r->sync1,sizeof(struct irtiming))) return i;
+    for (i=0; i<TIMINGS; i++)
+        if (Timings[i].bits == 0xff) break; // free entry, erased flash
+    if (i < TIMINGS) memcpy(&Timings[i],&r->sync1,sizeof(struct irtiming));
+    return i;
+}
+
+// write the header page from Timings. erase: the page holds other data, else only free entries are written
+void writehead(BYTE erase)
+{
+    struct tablehead *h = (void*)flashbuf;
+
+    memset(flashbuf,0xff,SPM_PAGESIZE);
+    h->magic = TABMAGIC;
+    memcpy(h->timing,Timings,sizeof(Timings));
+    Page = MINPAGE;
+    if (erase) flash_write_page(MINPAGE,flashbuf);
+    else flash_program_page(MINPAGE,flashbuf); // free entries and an empty header page are erased flash
+}
+
+// write new timings of the dictionary to the header page
+void savehead(void)
+{
+    struct tablehead *h = (void*)flashbuf;
+
+    Page = MINPAGE;
+    flash_read_page (MINPAGE, flashbuf);
+    if ((h->magic != TABMAGIC) || memcmp(h->timing,Timings,sizeof(Timings))) writehead(0);
+}
+
+/* load the timing dictionary at power on. An empty table has no header yet.
+returns 1 for a table in the old format (16 Byte struct ircode records from MINPAGE on), checkdir() erases it.
+*/
+BYTE loadtimings(void)
+{
+    struct tablehead *h = (void*)flashbuf;
+
+    Page = MINPAGE;
+    flash_read_page (MINPAGE, flashbuf);
+    if (h->magic == TABMAGIC) memcpy(Timings,h->timing,sizeof(Timings));
+    else
+    {
+        memset(Timings,0xff,sizeof(Timings)); // empty
+        if (h->magic != 0xffffffffL) return 1; // the first comparecode of an old table
+    }
+    return 0;
+}
+
+/* Hot translation cache: the last CACHESIZE translated records in RAM, so repeated keypresses
+(volume, channel) skip the directory and flash lookup. Filled round robin.
+Only single records are cached, chains need their followon records from flashbuf, waveforms their data slots.
+Must be cleared whenever the table in flash changes (storecode, erase).
+In learnmode the cache is not used, its RAM holds the waveform capture then (Rawbuf), learnend() clears it.
+*/
+#ifdef CACHE
+// returns the cached record for CS.comparecode or 0
+struct ircode *findcache(void)
+{
+    BYTE i;
+
+    for (i=0; i<CACHESIZE; i++)
+        if (Cache[i].comparecode == CS.comparecode) return &Cache[i]; // empty entries are 0, never received
+    return 0;
+}
+
+// add the record PCS found by findcode()
+void addcache(void)
+{
+    if ((PCS->next == 0xAA) || (PCS->bits == BITS_RAW)) return; // chain or waveform
+    memcpy(&Cache[Cachenext],PCS,sizeof(struct ircode));
+    if (++Cachenext >= CACHESIZE) Cachenext=0;
+}
+#endif
+
+void clearcache(void)
+{
+#ifdef CACHE
+    if (Learnstate == LS_D) return; // Rawbuf
+    memset(Cache,0,sizeof(Cache));
+#endif
+    WF(if (Txraw) Repsync1 = 0); // the repeat of a waveform reads its data slots
+}
+
+/* check the directory at power on and rebuild it from the code table if it is not valid:
+first start, table programmed with a hexfile, or power lost while the table and the directory were changed.
+The directory is valid if the magic is set and Head is where the log in flash ends.
+Loads the timing dictionary (and erases an old table) and finds the log first.
+The rebuild inserts the chains oldest first. A code found in the directory already is a duplicate left by
+a power loss during compaction (live records of the Tail page appended again, the page not yet erased) or an update
+(the old chain not yet deleted): the entry takes the newer copy and the older one is deleted, else deleting
+the newer one (menu 9) or an update would bring it back. A new entry may land further than DIRPROBE from its
+home then, EE_PROBE keeps the lookups right. Only if it does not fit at all the chain is deleted.
+*/
+void checkdir(void)
+{
+    SLOT i,s,t;
+    WORD d;
+    ULONG code;
+
+    if ((hal_ee_read(EE_MAGIC) == ERASEMAGIC) || loadtimings()) // power lost while erasing, or an old table
+    {
+        starterase();
+        return;
+    }
+    findlog();
+    if ((hal_ee_read(EE_MAGIC) != DIRMAGIC) || (dirhead() != Head))
+    {
+        if (hal_ee_read(EE_MAGIC) == FPMAGIC) clearprofiles(); // their place held fingerprints
+        hal_ee_write(EE_MAGIC, 0);
+        for (d=0; d<DIRSIZE; d++) dirput(d,DIREMPTY);
+        hal_ee_write(EE_PROBE, 0);
+        for (i=used(), s=Tail*RECPERPAGE; i; i--, s=nextslot(s)) // rebuild
         {
-            flag=1; //its a 1 bit
-            cod1++; //count coding short-long
+            code = slotrec(s)->comparecode; // followon records and deleted ones are 0, they have no entry
+            if (!code) continue;
+            d = dirfind(code,RECORDS);
+            if (d < DIRSIZE) // a duplicate
+            {
+                t = Rec;
+                dirset(d,code,s);
+                killrec(t);
+            }
+            else if ((d = dirfree(code,0xff)) < DIRSIZE) dirset(d,code,s);
+            else killrec(s);
         }
-        else // all lows, its a 0
-        {
-            al+=w1;  // add both values to calc average bit 0 duration-time
-            al+=w2;
-            lc+=1;   // inc 0-bit count
+        setdirhead();
+        hal_ee_write(EE_MAGIC, DIRMAGIC);
+    }
+    Page = 0; // flashbuf was used for the rebuild
+}
 
+// Head as stored in the directory
+SLOT dirhead(void)
+{
+    SLOT h = hal_ee_read(EE_HEAD);
+
+#if SLOTBYTES > 1
+    h |= hal_ee_read(EE_HEAD+1) << 8;
+#endif
+    return h;
+}
+
+// store Head in the directory, after its entries
+void setdirhead(void)
+{
+    hal_ee_write(EE_HEAD, Head);
+#if SLOTBYTES > 1
+    hal_ee_write(EE_HEAD+1, Head >> 8);
+#endif
+}
+
+// 1 if slot s is in the log, from Tail to Head
+BYTE inlog(SLOT s)
+{
+    return ((WORD)s + RECORDS - Tail*RECPERPAGE) % RECORDS < used();
+}
+
+/* Directory: a hash table of DIRSIZE entries in eeprom, one per chain (its first record, comparecode not 0).
+An entry is the slot of the record and a fingerprint of its code in the Bits above (see dirkey), DIREMPTY if free.
+A code is at its home entry or the next ones (linear probing), there is no empty entry in between.
+EE_PROBE is the furthest any entry is from its home, so a lookup reads at most EE_PROBE+1 entries: learning takes
+a code only if a free entry is within DIRPROBE of its home (dirfree), a delete moves the entries behind
+closer to their home (dirremove). With the table filled up to 3/4 of the entries a miss reads about 8 entries,
+and the page of a wrong record in 1 of 8 misses (6 Bit fingerprint on the atmega328p).
+*/
+// the fingerprint of code in the Bits above the slot, its home entry in Dirhome
+WORD dirkey(ULONG code)
+{
+    ULONG h = (code ^ (code >> 16)) * 0x9E3779B1UL; // multiplicative hash, the upper Bits are mixed best
+
+    Dirhome = (WORD)(h >> 16) % DIRSIZE;
+    return (WORD)((BYTE)(h >> 8) >> (DIRBITS-8)) << DIRBITS;
+}
+
+WORD dirget(WORD i)
+{
+    return hal_ee_read(EE_DIR+2*i) | ((WORD)hal_ee_read(EE_DIR+2*i+1) << 8);
+}
+
+void dirput(WORD i, WORD e)
+{
+    hal_ee_write(EE_DIR+2*i, e);
+    hal_ee_write(EE_DIR+2*i+1, e >> 8);
+}
+
+/* find the entry of code. s = RECORDS: the record it points to must be in the log and have the comparecode,
+Rec is its slot then. Else the entry must point to slot s, the record is not read.
+returns the index of the entry, DIRSIZE if there is none
+*/
+WORD dirfind(ULONG code, SLOT s)
+{
+    WORD e,i,k = dirkey(code);
+    BYTE n = hal_ee_read(EE_PROBE);
+
+    for (i=Dirhome; ; n--)
+    {
+        e = dirget(i);
+        if (e == DIREMPTY) break;
+        if ((e & ~DIRSLOT(0xffff)) == k)
+        {
+            if (s < RECORDS)
+            {
+                if (DIRSLOT(e) == s) return i;
+            }
+            else if (inlog(DIRSLOT(e)) && (slotrec(DIRSLOT(e))->comparecode == code)) // not during an erase
+            {
+                Rec = DIRSLOT(e);
+                return i;
+            }
         }
+        if (!n) break;
+        if (++i >= DIRSIZE) i=0;
+    }
+    return DIRSIZE;
+}
+
+// a free entry for code at most limit entries from its home, DIRSIZE if there is none
+WORD dirfree(ULONG code, BYTE limit)
+{
+    WORD i;
+    BYTE n;
+
+    dirkey(code);
+    for (i=Dirhome, n=0; dirget(i) != DIREMPTY; n++)
+    {
+        if (n == limit) return DIRSIZE;
+        if (++i >= DIRSIZE) i=0;
+    }
+    return i;
+}
+
+// point entry i to the record of code in slot s, keep EE_PROBE. i = DIRSIZE is no entry
+void dirset(WORD i, ULONG code, SLOT s)
+{
+    WORD n;
+
+    if (i >= DIRSIZE) return;
+    dirput(i,dirkey(code) | s);
+    n = (i + DIRSIZE - Dirhome) % DIRSIZE;
+    if (n > hal_ee_read(EE_PROBE)) hal_ee_write(EE_PROBE, n);
+}
+
+/* free entry i: the entries up to the next empty one move into the gap if their home is not behind it,
+so a lookup never stops at the gap before its code. Reads the record of each entry for its home.
+*/
+void dirremove(WORD i)
+{
+    WORD e,j=i;
+
+    for (;;)
+    {
+        if (++j >= DIRSIZE) j=0;
+        e = dirget(j);
+        if (e == DIREMPTY) break;
+        dirkey(slotrec(DIRSLOT(e))->comparecode);
+        if ((j + DIRSIZE - Dirhome) % DIRSIZE < (j + DIRSIZE - i) % DIRSIZE) continue; // its home is after the gap
+        dirput(i,e);
+        i = j;
+    }
+    dirput(i,DIREMPTY);
+}
+
+/* the directory is invalid while a change takes more than one write, a power loss rebuilds it (see checkdir).
+returns the magic to write back to EE_MAGIC when done, so it nests
+*/
+BYTE dirbegin(void)
+{
+    BYTE m = hal_ee_read(EE_MAGIC);
+
+    hal_ee_write(EE_MAGIC, 0);
+    return m;
+}
+
+// 1 if the table page is erased, read without flashbuf
+BYTE blankpage(BYTE page)
+{
+    WORD a = page * SPM_PAGESIZE;
+    BYTE i;
+
+    for (i=0; i<SPM_PAGESIZE; i++)
+        if (hal_flash_byte(a+i) != 0xff) return 0;
+    return 1;
+}
+
+
+
+
+// a is within 1/8 of b, plus the quantization of 2*40us
+static BYTE near(BYTE a, BYTE b)
+{
+    BYTE d = (a > b) ? a-b : b-a;
+    return d <= (b>>3) + 2;
+}
+
+/* Repeat frame of a held key (NEC): sync1, a half long sync2 and the stop pulse, no Bits.
+It repeats the last frame, if that one was translated with the same sync1 and twice the sync2.
+*/
+BYTE isrepeat(struct rxframe *f)
+{
+    return Repsync1 && near(f->sync1,Repsync1) && (f->sync2 < 128) && near(f->sync2<<1,Repsync2);
+}
+
+#ifdef RXPROF
+/* Receive profiles: sync, bitcount and stoplen of the frames of the remotes we translate.
+A frame that matches a profile is complete with its stoplen (the last duration), the capture isr ends it
+at once instead of waiting 15ms for the Timer2 timeout. Other frames still end by the timeout.
+Profiles are added when a code S is learned and when a received frame was found in the table
+(so tables learned before keep working), and kept in eeprom. Filled round robin.
+The sync of remotes differs by less than near() allows (JVC 8.4/4.2ms, NEC 9/4.5ms), a profile takes
+a frame by its sync within 1/32 only. And a frame does not end early while a profile with about its
+sync expects more Bits: the JVC profile (16 Bits) would cut a NEC frame after 16 Bits.
+*/
+// a is within 1/32 of b, plus the quantization of 2*40us
+static BYTE nearsync(BYTE a, BYTE b)
+{
+    BYTE d = (a > b) ? a-b : b-a;
+    return d <= (b>>5) + 2;
+}
 
-        if (flag)
+// returns 1 if the frame f in the capture isr has a profile and is complete with its last duration w1
+BYTE endprofile(struct rxframe *f)
+{
+    struct rxprof *p;
+    BYTE end = 0;
+
+    for (p=Prof; p<Prof+NPROF; p++)
+    {
+        if (p->bits == 0xff || !near(f->sync1,p->sync1) || !near(f->sync2,p->sync2)) continue;
+        if (p->bits > f->bits) return 0; // may be a longer frame
+        if (p->bits == f->bits && nearsync(f->sync1,p->sync1) && nearsync(f->sync2,p->sync2) && near(f->w1,p->stoplen)) end = 1;
+    }
+    return end;
+}
+
+// add the profile of the frame in CS, if it is new
+void addprofile(void)
+{
+    struct rxprof *p;
+    BYTE i;
+
+    if (!CS.stoplen) return; // no stoplen, the frame ends by the timeout only
+    for (p=Prof; p<Prof+NPROF; p++)
+        if (p->bits == CS.bits && nearsync(CS.sync1,p->sync1) && nearsync(CS.sync2,p->sync2) && near(CS.stoplen,p->stoplen)) return;
+
+    p = &Prof[Profnext];
+    cli(); // used by the capture isr
+    p->sync1 = CS.sync1;
+    p->sync2 = CS.sync2;
+    p->bits = CS.bits;
+    p->stoplen = CS.stoplen;
+    sei();
+    for (i=0; i<sizeof(struct rxprof); i++) hal_ee_write(EE_PROF + Profnext*sizeof(struct rxprof) + i, ((BYTE*)p)[i]);
+    if (++Profnext >= NPROF) Profnext=0;
+}
+
+void loadprofiles(void)
+{
+    BYTE i;
+
+    for (i=0; i<sizeof(Prof); i++) ((BYTE*)Prof)[i] = hal_ee_read(EE_PROF+i); // erased eeprom: bits 0xff, never matches
+    Profnext=0;
+}
+
+void clearprofiles(void)
+{
+    BYTE i;
+
+    for (i=0; i<sizeof(Prof); i++) hal_ee_write(EE_PROF+i, 0xff);
+    loadprofiles();
+}
+#endif
+
+/*
+Streaming decoder: the capture isr hands every duration of the frame to rxstep() as it arrives,
+decodeframe() finishes the decode after the end of the frame. So the raw durations need not be stored.
+n is the index of the duration in the frame (Capcnt): 1=sync1, 2=sync2, then Bit pairs w1,w2.
+Each pair is classified when its second duration arrives:
+if w1 > w2*2 or w2 > w1*2, its a 1 (the order gives the coding), else its a 0.
+The code is shifted in from the top, decodeframe() aligns it. (no variable 32bit shift in the isr)
+A single duration after the last pair is the stoplen.
+Until the first 0-Bit the timing comes from the 1-Bits, so a code of all 1-Bits is taken. Their long halves must
+be alike: if no 0-Bit follows, two lengths of 1-Bits are a code this decoder can't tell (f.e. Sharp, learned as waveform).
+*/
+void rxstep(struct rxframe *f, BYTE n, BYTE d)
+{
+    BYTE w1 = f->w1;
+
+    if (n < 3)
+    {
+        if (n == 1) f->sync1 = d;
+        else f->sync2 = d;
+        return;
+    }
+    if (n & 1) // first half of a Bit, or the stoplen
+    {
+        f->w1 = d;
+        return;
+    }
+    f->w1 = 0; // pair complete
+
+    if (f->bits == 32) // we are after bit32 but not end of data-> error, unsupported longer code
+    {
+        f->err = 1;
+        return;
+    }
+    f->bits++;
+    f->code >>= 1;
+
+    if (w1 > (d<<1))
+        f->cod0++; //count coding long-short
+    else if (d > (w1<<1))
+        f->cod1++; //count coding short-long
+    else // all lows, its a 0
+    {
+        if (!f->lc) // the first 0-Bit: drop the timing of the 1-Bits
         {
-            ah+=w2; // add both values to calc average bit 1 duration-time
-            ah+=w1;
-            hc+=1;  // inc 1-bit count
-            l|=1L<<b;  //set 1-bit
+            f->al = 0;
+            f->err &= 1;
         }
+        f->al += w1;  // add both values to calc average bit 0 duration-time
+        f->al += d;
+        f->lc++;      // inc 0-bit count
+        return;
+    }
+    f->ah += w1; // add both values to calc average bit 1 duration-time
+    f->ah += d;
+    f->hc++;     // inc 1-bit count
+    f->code |= 0x80000000L; //set 1-bit
+
+    if (f->lc) return;
+    if (w1 < d) // w1 the long half, d the short half
+    {
+        BYTE t = w1;
+        w1 = d;
+        d = t;
+    }
+    f->al += d << 1; // short half twice, like a 0-Bit
+    if (!f->l1) f->l1 = w1;
+    else if ((w1 > f->l1 + (f->l1>>2)) || (w1 < f->l1 - (f->l1>>2))) f->err |= 2; // another length of 1-Bits
+}
+
+/*
+Finish the decode of the received frame f and fill the global CS struct so we can compare it with table entrys.
+NOTE: a 1-bit can be double or trible the 0-bit length!
+Modulation may have not a 50% duty cycle, so time-values for high/low may be different!
+Most common the Puls-duration is longer asto achieve a stronger illumination ie.distance,
+but its better to increase the Pulscycle of the 38khz oscillator to get better illumination power!!
+We are workig on a 50% duty cyle so: Bittime0=(t1+t2)/2; Bittime 1=Bittime0/2 + ((t1+t2) - Bittime0/2)
+returns 0=OK;1=error
+*/
+BYTE decodeframe(struct rxframe *f)
+{
+    WORD al, ah;
+    BYTE ret = f->err;
 
-    } //endfor
+    CS.sync1 = f->sync1;
+    CS.sync2 = f->sync2;
+    CS.stoplen = f->w1; // single duration after the last Bit pair, or 0
 
-    if (cod0&&cod1) ret++; // error, both codings are present
-    if (cod0>1) CS.coding=0; // at least 2 1-Bit-codings must be present, to filter in between syns,if RC5.
-    else if (cod1>1) CS.coding=1;
+    if (f->cod0 && f->cod1) ret++; // error, both codings are present
+    if (f->cod0>1) CS.coding=0; // at least 2 1-Bit-codings must be present, to filter in between syns,if RC5.
+    else if (f->cod1>1) CS.coding=1;
     else ret++; // error no pulslength coding detected
 
-    CS.sendcode=CS.comparecode=l; // set both codes to the found one for findcode to work
-    CS.bits = b;
-	
+    CS.sendcode=CS.comparecode = f->bits ? f->code >> (32 - f->bits) : 0; // set both codes to the found one for findcode to work
+    CS.bits = f->bits;
+
 
     // calc bittimes based on averages
-    al /=lc;  // divide total 0-Bit durations by the 0-Bit-count = average 0-Bit Time
-    ah /=hc;  // divide total 1-Bit durations by the 1-Bit-count = average 1-Bit Time
+    if (!f->hc) return ret; // no 1-Bits: already an error (no coding)
+    al = f->al / (f->lc ? f->lc : f->hc);  // divide total 0-Bit durations by the 0-Bit-count = average 0-Bit Time
+    ah = f->ah / f->hc;  // divide total 1-Bit durations by the 1-Bit-count = average 1-Bit Time
     if (al&1) al++; // we need even values, round up, there are always truncations on divisions
     if (ah&1) ah++;
     al >>=1; // /2 = average Half-0-Bit-Time
@@ -565,96 +1345,276 @@ BYTE decodebuf(void)
     return ret;
 }
 
+#ifdef HOSTED
+/* Decode a recorded frame: the durations in buf[1..] up to 0, like the capture isr would have received them.
+Used by host/irbench to replay a corpus of recorded frames.
+*/
+BYTE decodebuf(BYTE *buf)
+{
+    struct rxframe f;
+    BYTE n;
+
+    memset(&f,0,sizeof(f));
+    for (n=1; (n<IOSIZE) && buf[n]; n++) rxstep(&f,n,buf[n]);
+    return decodeframe(&f);
+}
+#endif
+
 
 
 
-/* Create the sample stream for Tx from PCS in iobuf. 
-It expects that PCS points to the record to get the ir-data from
+/* Set up the transmitter for the record PCS points to (Tr at Rec for chains): the periods of its durations
+in us, so the compare isr does no multiplication, and the sendcode whose Bits it walks (see txnext).
+Then PCS is set to the next record of a chain, so the isr starts it without reading the table.
 added multicode support.
 */
-void setuptxbuf(void)
+void setuptx(void)
 {
-    BYTE *pd, i;
-    ULONG l;
-// prepare iobuf from PCS:
-    pd=iobuf;
-    l=PCS->sendcode;
-    *pd++=PCS->sync1;
-    *pd++=PCS->sync2;
+    WF(Txraw = 0);
+    Txgap = ((PCS->coding & TC_GAP) >> 3) * GAPUNIT; // a waveform has the defaults
+    Txrepeat = (PCS->coding & TC_REPEAT) >> 1;
+    if (PCS->bits == BITS_RAW) // the isr unpacks it from flash
+    {
+#ifdef WAVEFORM
+        rawsetup();
+#else
+        Txdur[TX_SYNC1] = 0; // not sent without WAVEFORM: the record ends at once
+#endif
+        PCS = 0; // it ends the chain
+        return;
+    }
+    Txdur[TX_SYNC1] = PCS->sync1; // the isr reverts the byte compression
+    Txdur[TX_SYNC2] = PCS->sync2;
+    Txdur[TX_ZERO] = PCS->timshort; // both halfs of a 0
+    Txdur[TX_ONE1] = (PCS->coding & TC_CODING) ? PCS->timshort : PCS->timlong; // a 1: coding 1 = short/long, 0 = long/short
+    Txdur[TX_ONE2] = (PCS->coding & TC_CODING) ? PCS->timlong : PCS->timshort;
+    Txdur[TX_STOP] = PCS->stoplen; // 0 = no stoplen
+    Txsend = PCS->sendcode;
+    Txend = TX_BITS + (PCS->bits<<1);
+
+// check for multi-records: set PCS to the next record if there or PCS=0
+	if (PCS->next == 0xAA) 
+		loadrec(nextslot(Rec)); // reads the next flashpage if it is on the next one
+	else
+		PCS = 0; //indicate there are now further records
+}
+
+// period of the next duration of the record, 0 at its end. in the compare isr
+WORD txnext(void)
+{
+    BYTE n = Txcnt;
 
-    for (i=0; i<PCS->bits; i++)
+    if (n >= TX_BITS) // else TX_SYNC1, TX_SYNC2
     {
-        if (l&1) // send a 1
+        if (n > Txend) return 0;
+        if (n == Txend) n = TX_STOP;
+        else // a Bit pair, the Bits LSB first
         {
-            if (PCS->coding) // short/long
-            {
-                *pd++=PCS->timshort;
-                *pd++=PCS->timlong;
-            }
-            else  //long/short
+            if (!(n & 1))
             {
-                *pd++=PCS->timlong;
-                *pd++=PCS->timshort;
+                Txone = Txcode & 1;
+                Txcode >>= 1;
             }
+            n = Txone ? ((n & 1) ? TX_ONE2 : TX_ONE1) : TX_ZERO;
         }
-        else // send 0
-        {
-            *pd++=PCS->timshort;
-            *pd++=PCS->timshort;
-        }
+    }
+    return Txdur[n] * 40; // revert the byte compression
+}
 
-        l>>=1;
-    } // endfor
+// data slots of the waveform record with this sendcode
+BYTE rawslots(ULONG sendcode)
+{
+    struct rawhead h;
 
-    if (PCS->stoplen) *pd++=PCS->stoplen;
-    *pd=0; //EOT
+    memcpy(&h,&sendcode,sizeof(h));
+    return h.slots;
+}
 
-// check for multi-records: set PCS to the next record if there or PCS=0
-	if (PCS->next == 0xAA) 
-	{
-		PCS++;
-
-		struct ircode *pcs = (void*)(flashbuf+SPM_PAGESIZE);
-		if (PCS >= pcs)  // if PCS is at the last record of flashpage, read in the next flashpage
-		{
-			Page++;
-	        flash_read_page (Page, flashbuf);
-			PCS = (void*)flashbuf;
-		}
-	}
-	else
-		PCS = 0; //indicate there are now further records
+#ifdef WAVEFORM
+/* Waveform records (see struct rawhead): send a code the pulse distance coding cannot represent.
+setup: the periods of the symbols go to Txdur, the data slots stay in flash. The compare isr reads one data Byte
+every 2, 4 or 8 durations with rawnext(), so a waveform needs no RAM buffer and may span pages.
+The record is in Tr at Rec.
+*/
+void rawsetup(void)
+{
+    struct rawhead *h = (void*)&PCS->sendcode;
+    BYTE i;
+
+    Rawdata = nextslot(Rec);
+    Rawsym = h->nsym;
+    Rawbits = h->bits;
+    for (i=0; i<Rawsym; i++) Txdur[i] = rawbyte(i);
+    Txraw = h->durs;
+}
+
+// start over at the first duration. by txgap()
+void rawrewind(void)
+{
+    Rawpos = Rawsym;
+    Rawleft = Txraw;
+    Rawhave = 0;
 }
 
+// period of the next duration of the waveform, 0 at its end. in the compare isr
+WORD rawnext(void)
+{
+    BYTE i;
 
+    if (!Rawleft) return 0;
+    Rawleft--;
+    if (!Rawhave)
+    {
+        Rawbyte = rawbyte(Rawpos++);
+        Rawhave = 8;
+    }
+    i = Rawbyte & ((1<<Rawbits)-1);
+    Rawbyte >>= Rawbits;
+    Rawhave -= Rawbits;
+    return Txdur[i] * 40;
+}
 
-// wait a little 400ms??
-void wait(void)
+// data Byte n of the waveform whose data slots start at Rawdata, read from flash
+BYTE rawbyte(BYTE n)
 {
-    volatile WORD w=0;
-    while (--w);
+    WORD s = Rawdata + n/RAWPERSLOT;
+
+    if (s >= RECORDS) s -= RECORDS; // the log wraps around
+    return hal_flash_byte((TABPAGE + s/RECPERPAGE)*SPM_PAGESIZE + (s%RECPERPAGE)*sizeof(struct irrec)
+                          + offsetof(struct irrec,sendcode) + n%RAWPERSLOT);
 }
 
-void waitlong(void)
+/* learnmode: add duration d of the frame to its waveform in Rawbuf, called by the capture isr.
+The symbols are collected in Rawbuf[0..RAWSYM-1]: a duration within 1/8 of a symbol (see near) is that symbol.
+The 4bit symbol index of every duration follows from Rawbuf[RAWSYM] on, 2 per Byte.
+Too many durations or symbols: Rawn = RAWBAD.
+*/
+void rawstep(WORD d)
 {
     BYTE i;
-    for (i=0; i<4; i++)
-        wait();
+
+    if ((Rawn >= RAWMAX) || !d || (d > 255))
+    {
+        Rawn = RAWBAD;
+        return;
+    }
+    for (i=0; (i<RAWSYM) && Rawbuf[i]; i++)
+        if (near(d,Rawbuf[i])) break;
+    if (i >= RAWSYM)
+    {
+        Rawn = RAWBAD;
+        return;
+    }
+    if (!Rawbuf[i]) Rawbuf[i] = d; // new symbol
+    Rawbuf[RAWSYM + (Rawn>>1)] |= (Rawn&1) ? i<<4 : i;
+    Rawn++;
+}
+
+/* pack the waveform in Rawbuf in place for storechain(): the symbols, then the indices with the least Bits
+(1, 2 or 4), the first duration in the low Bits of the first Byte. No Byte is written before it was read.
+returns the struct rawhead for the sendcode of its record
+*/
+ULONG rawpack(void)
+{
+    struct rawhead h;
+    ULONG l;
+    BYTE k, i, acc=0, have=0, w;
+
+    for (h.nsym=0; (h.nsym<RAWSYM) && Rawbuf[h.nsym]; h.nsym++);
+    h.bits = (h.nsym <= 2) ? 1 : (h.nsym <= 4) ? 2 : 4;
+    h.durs = Rawn;
+    w = h.nsym;
+    for (k=0; k<Rawn; k++)
+    {
+        i = Rawbuf[RAWSYM + (k>>1)];
+        if (k&1) i >>= 4;
+        acc |= (i & 0x0f) << have;
+        have += h.bits;
+        if (have == 8)
+        {
+            Rawbuf[w++] = acc;
+            acc = have = 0;
+        }
+    }
+    if (have) Rawbuf[w++] = acc;
+    h.slots = (w + RAWPERSLOT-1) / RAWPERSLOT;
+    memcpy(&l,&h,sizeof(l));
+    return l;
+}
+#endif
+
+
+
+/* UI: status LED blink patterns and learn button debounce, timed by the Timer1 compare B tick (UITICK).
+The tick runs only while a pattern is shown or the button is debounced, the interrupts are never blocked.
+LED pattern: cnt times UI_ON on, UI_OFF off, then UI_PAUSE more off. Once or repeated (prompts).
+Button: INT1 (falling edge) starts the debounce and is off until the button is released.
+A press counts when the button is down for UI_DEBOUNCE ticks.
+*/
+void ui_blink(BYTE cnt, BYTE repeat)
+{
+    cli();
+    Blinks = cnt;
+    Blinkrep = repeat;
+    Blinkph = cnt<<1;
+    Uitime = 1; // starts at the next tick
+    hal_led_off();
+    ui_start();
+    sei();
+}
+
+// start the tick if it is not running. interrupts disabled
+void ui_start(void)
+{
+    if (!hal_tick_running()) hal_tick_start(UITICK);
 }
 
-// blink LED cnt times ,with pause at end
-void blink(BYTE cnt)
+ISR(TIMER1_COMPB_vect)
 {
+    BYTE b;
+
+    hal_tick_period(UITICK);
+
+    if (Butcnt) // debounce: the level must be stable for UI_DEBOUNCE ticks
+    {
+        b = hal_button();
+        if (b != Butlevel)
+        {
+            Butlevel = b;
+            Butcnt = UI_DEBOUNCE; // bounced, again
+        }
+        else if (!--Butcnt)
+        {
+            if (b != Butdown)
+            {
+                Butdown = b;
+                if (b) Learnbut++; // signal button pressed
+            }
+            if (b) Butcnt = 1; // wait for the release
+            else hal_button_start(); // released, INT1 for the next press
+        }
+    }
 
-    while (cnt--)
+    if (Blinks && !--Uitime) // next phase of the LED pattern
     {
-        bset(2,PORTD);
-        wait();
-        bclr(2,PORTD);
-        wait();
-        wait();
+        if (!Blinkph && Blinkrep) Blinkph = Blinks<<1; // show it again
+        if (!Blinkph) Blinks = 0; // done
+        else if (--Blinkph & 1)
+        {
+            hal_led_on();
+            Uitime = UI_ON;
+        }
+        else
+        {
+            hal_led_off();
+            Uitime = Blinkph ? UI_OFF : UI_OFF+UI_PAUSE;
+        }
     }
-    waitlong();
+
+#ifdef PROVISION
+    if (Pvawake && --Pvawake) return; // the host talks to us, the running tick keeps us out of power-down
+#endif
+    if (!Blinks && !Butcnt) hal_tick_stop(); // nothing to do, no more ticks
 }
 
 
@@ -674,51 +1634,109 @@ endif
 - save the timer1-cap value (ICR1) for next occurence
 - inc capture count=index to receive buffer.
 
-Format of the receive buffer:
-Byte0=Errorcounter. If there where receive errors or repeatframes, we discard the reception
-Bytes1 to 80 = the time durations in the form: Marktime,Spacetime,Marktime,Spacetime,......stoplen-time?
+Each duration is handed to the streaming decoder rxstep(), in the form: Marktime,Spacetime,Marktime,Spacetime,......stoplen-time?
 Marktime=Mark(38khz-on)
 Spacetime=Space (0,silence)
 So there are always Mark/Space valuepairs.....except the last single value (if present) and is the EOT-indication
+With DBPRINT the durations are also stored in Trraw for the trace, if it is free (see trframe).
 Receptions longer than 68 Bytes are discarded. 
+If the frame matches a receive profile (see endprofile), it ends with the stoplen, without the timeout.
+So does the repeat frame of a held key (see isrepeat).
+Edges while our own transmitter sends a record are its echo (the receiver sits next to the IR LEDs),
+such frames are discarded.
 */
 ISR(TIMER1_CAPT_vect)
 {
-    if (btst(ICES1,TCCR1B)) //toggle edge select CapInt
-        bclr(ICES1,TCCR1B);
-    else
-        bset(ICES1,TCCR1B);
+    rxedge(hal_capture_value()); // get capture value timer1
+}
+
+/* wakeup from power-down by the first edge of a frame (start of the sync Mark), see deepsleep().
+Timer1 did not run while sleeping, so the edge is taken as the first capture now (the first capture
+measures nothing), the next edges are captured by ICP1 again.
+*/
+ISR(PCINT0_vect)
+{
+    hal_wake_disarm();
+    if (hal_rx_mark() && !Capcnt && hal_capture_running()) rxedge(hal_timer1());
+}
+
+#ifdef PROVISION
+// wakeup from power-down by a Byte on RXD, it is lost. stay awake for the next requests
+ISR(PCINT2_vect)
+{
+    hal_wake_disarm();
+    Pvawake = PV_AWAKE;
+    ui_start();
+}
+#endif
+
+// an edge at Timer1 time cnt
+void rxedge(WORD cnt)
+{
+    hal_capture_toggle_edge(); //toggle edge select CapInt
+
+    if (Noise) // the burst was rejected, wait for its end
+    {
+        hal_timeout_guard();
+        return;
+    }
+    if (Txon) Errors++; // our own transmitter, discard the frame
 
-    TCNT2 = 135; // re-set Timer2 counter so it not overflows. 135=15ms
+    hal_timeout_restart(); // re-set Timer2 counter so it not overflows. 135=15ms
 
-    WORD cnt = ICR1; // get capture value timer1
     WORD diff = cnt - Lastcap; // calc time difference. works even if T1 overflowed. uint16 math includes modulo
 
 
     if (!Capcnt) // if this is the first transition.ie. start of transmission
     {
-        bset(TOV2,TIFR2); // clear Tim2 Overflow IntFlag
-        bset(TOIE2,TIMSK2); // enable overflow interrupt Timer2
-
+        hal_timeout_start(); // clear Tim2 Overflow IntFlag, enable overflow interrupt Timer2
+        TR(if (!Trslot) Trslot = Rxhead+1); // record the durations, Trraw is free
+#ifdef WAVEFORM
+        if (Rawon) // learnmode: record the waveform too, not over our own transmission
+        {
+            Rawn = Txbusy ? RAWBAD : 0;
+            memset(Rawbuf,0,RAWSYM+RAWMAX/2);
+        }
+#endif
     }
     else
     {
-        if (diff > 10200) //> 10.2 ms
+        if (diff > 10200) //> 10.2 ms. some protocols have upto 9.5ms , or have in between sync bits of about 4.5ms
         {
-            Errors++; //duration longer than 10.2 ms.some protocols have upto 9.5ms , or have in between sync bits of about 4.5ms
+            noise((Capcnt == 1) ? NZ_SYNC : NZ_LONG);
+            return;
         }
         diff /= 40; // convert to Bytevalue
 
+        // no decoded protocol starts with a Mark this short. a waveform may start with a Bit (Sharp 320us, Denon 260us)
+        if ((Capcnt == 1) && (diff < RXSYNCMIN) WF(&& !Rawon))
+        {
+            noise(NZ_SYNC);
+            return;
+        }
+        if (diff < RXMIN) // also a duration of 0
+        {
+            noise(NZ_SHORT);
+            return;
+        }
+        WF(if (Rawon) rawstep(diff));
 
-        if (!diff) Errors++; // duration is 0
-
-        if (Capcnt<(IOSIZE-1)) iobuf[Capcnt]= diff; // store duration in buffer
+        if (Capcnt<(IOSIZE-1))
+        {
+            rxstep(Rx,Capcnt,diff); // decode the duration
+#ifdef DBPRINT
+            if (Trslot == Rxhead+1) Trraw[Capcnt]= diff; // store duration in buffer
+#endif
+        }
         else Errors++; // too long reception
     }
 
     Lastcap = cnt; // save the timer1-cap value (ICR1) for next interrupt
     Capcnt++; // inc cap counter
 
+    if (!(Capcnt&1) && (Capcnt >= 20) && endprofile(Rx)) endframe(); // a single duration after the Bit pairs: the stoplen of a known frame
+    else if ((Capcnt == 4) && isrepeat(Rx)) endframe(); // repeat frame of a held key is complete
+
 }
 
 
@@ -727,40 +1745,73 @@ ISR(TIMER1_CAPT_vect)
 IR code Transmitter:
 The duration of a period has expired.
 
-if the next duration in the table is not zero, and not IOSIZE items reached
-- load it into the compare register
+if the pause before the record is not over (Txwait), wait the next part of it
+if the next duration of the record is not zero (see txnext, or rawnext of a waveform record)
+- add it to the compare register
+- if a record would start while the receiver takes a frame, wait until the frame is over
 - set Tx State:
-	- Capcnt even = MARK (38khz on) COM0A0 in TCCR0A =1
-	- Capcnt odd  = Space (0)		COM0A0 in TCCR0A =0
+	- Txcnt even = MARK (38khz on) COM0A0 in TCCR0A =1
+	- Txcnt odd  = Space (0)		COM0A0 in TCCR0A =0
 else
-- terminate transmission and reset to known state.
+- send the record again (TC_REPEAT), start the next record of a chain or stop the transmitter.
+  The pause before it runs from this compare match on. The receiver keeps running.
 */
 ISR(TIMER1_COMPA_vect)
 {
-    WORD cnt = iobuf[Capcnt]; // get next timevalue or 0 as EOT
+    WORD cnt;
+
+    if (Txwait) // a pause longer than a Timer1 period
+    {
+        hal_compare_period(txwait());
+        return;
+    }
+    if (!Txcnt && Capcnt && !Errors) // a remote frame is being received, dont send into it
+    {
+        hal_compare_period(2000); // look again in 2ms
+        return;
+    }
+
+#ifdef WAVEFORM
+    cnt = Txraw ? rawnext() : txnext(); // get next period or 0 as EOT. a waveform is unpacked from flash
+#else
+    cnt = txnext(); // get next period or 0 as EOT
+#endif
 
     if  (cnt) 
     {
-        cnt *= 40; // revert the byte compression
-        OCR1A = cnt; // set new period time
-        if (!(Capcnt&1))
-            bset(COM0A0,TCCR0A); // Mark 38khz
+        hal_compare_period(cnt); // set new period time
+        if (!(Txcnt&1))
+        {
+            hal_ir_mark(); // Mark 38khz
+            Txon=1;
+        }
         else
-            bclr(COM0A0,TCCR0A); //Space 0
-        Capcnt++;
+            hal_ir_space(); //Space 0
+        Txcnt++;
+        return;
+    }
+
+    hal_ir_space(); // end of record
+    Txon=0;
+
+    if (Txrep) // send it again
+    {
+        Txrep--;
+        hal_compare_period(txgap());
     }
     else if (PCS) // if there is another record to transmit
 	{
-		setuptxbuf();
-		set_transmitter();
+        PRF_START(tset);
+		setuptx();
+        PRF_STOP(PRF_TXSETUP,tset);
+        Txrep = Txrepeat;
+        hal_compare_period(txgap());
 	}
 	else
     {
-        set_receiver(); // terminate transmission
+        hal_compare_stop(); // terminate transmission
+        Txbusy=0;
     }
-	
-// you can optionally enlarge the transmission gap by calling set_transmitter() several times with global countdown variable!
-
 }
 
 /* Timer2 Receive Timeout generator = end of reception after 15ms no transition on ICT1.
@@ -768,181 +1819,502 @@ Its clocked by 8Mhz/1024 so times out at TOP(255) after 15ms.
 During each capture interrupt its count value is preset again.
 At end of transmission (no more capture  ints) it will overflow and generate an ovl interrupt to end the reception here.
 
-- decode received stream into CS
-if notOK,
-	- init receiver; return
-else reception OK
-	- find translate code in table
-	if found
-		- init transmitter; return;
-	else goto NotOK;
+- terminate the frame in its receive slot
+if valid frame (no errors, enough halfbits) or repeat frame
+	- queue it for doframe() in the main loop
+- rearm the receiver on the next free slot at once, so back to back frames are captured
+After a burst of noise (see noise()) it only rearms the receiver.
 
-NOTE: once in an interrupt routine, all other interrupts are disabled!
+NOTE: once in an interrupt routine, all other interrupts are disabled! So keep it short,
+decoding and lookup run in the main loop with interrupts enabled.
 Interrupt priority defined by vector-number, so CapInt has higher prio than Overflow
 */
 ISR(TIMER2_OVF_vect)
 {
-    bclr(TOIE2,TIMSK2); // disable overflow interrupt Timer2
-    bclr(ICIE1,TIMSK1); // disable capture int
-    iobuf[Capcnt]=0; // EOF, terminate receive buffer
-
-    if (Capcnt < 20) Errors++; // repeat frame or invalid frame ie. less than 20 halfbits received
-
-    if (!Errors&&!decodebuf())  // if valid frame was received...ie.valid data in CS
+    if (Noise) // the burst of noise is over, nothing was received
     {
-		if (Debug==1) bset(2,PIND); // toggle LED on every code received
+        hal_timeout_stop();
+        set_receiver();
+    }
+    else endframe();
+}
+
+/* Reject the frame being captured as a burst of noise (sunlight, CFL lamps, plasma TVs), at its first
+implausible duration. Its edges are ignored until the receiver was silent for 4ms (hal_timeout_guard),
+then it is armed again at once: no capture up to the 15ms timeout, no decode, a frame right after is not lost.
+In learnmode the waveform is dropped too, Rawbuf is restarted by the next frame.
+why: NZ_SYNC.. counted in Rejects. called in interrupt
+*/
+void noise(BYTE why)
+{
+    Noise = 1;
+    Errors++; // the transmitter does not wait for it
+    if (!Txon && (Rejects[why] < 0xffff)) Rejects[why]++; // not the echo of our own transmitter
+    hal_timeout_guard();
+}
 
+// end of the frame, by the timeout or early by its profile. called in interrupt
+void endframe(void)
+{
+    PRF_START(teot);
+    hal_timeout_stop(); // disable overflow interrupt Timer2
+    hal_capture_stop(); // disable capture int
 #ifdef DBPRINT
-        printdb();
+    if ((Trslot == Rxhead+1) && (Capcnt < IOSIZE)) Trraw[Capcnt]=0; // EOF, terminate receive buffer
+    Rx->teot = hal_timer1();
 #endif
 
-        if (!Learnbut) // dont translate in learnmode!
+    BYTE repeat = (Capcnt == 4) && isrepeat(Rx);
+    if ((Capcnt < 20) && !repeat) Errors++; // invalid frame ie. less than 20 halfbits received. a repeat frame of a held key is queued with 0 bits
+    if (Rx->err) Errors++; // more than 32 Bits, or 1-Bits of 2 lengths
+#ifdef WAVEFORM
+    if (Rawon) // learnmode: its waveform stays in Rawbuf until doframe() took the frame
+    {
+        Rawon = 0;
+        if (Rawn >= RAWMIN && Rawn <= RAWMAX)
         {
-			if ((Debug==3)&&(CS.bits==32)) bset(2,PIND); // toggle LED on 32bit code received
-			if ((Debug==4)&&(CS.bits==16)) bset(2,PIND); // toggle LED on 32bit code received
-	
-			
-            if (!findcode()) // if found translate code
-            {
-				if (Debug==2) bset(2,PIND); // toggle LED on code compare match
-
-                setuptxbuf();
-                set_transmitter();
-                return;
-            }
+            Rawq = Rxhead+1;
+            if (Errors) Rx->err = 1; // queued for the waveform, the decode fails
+            Errors = 0;
         }
-        Gotcode++; // flag reception OK, valid code in CS. used for learncode
+    }
+#endif
+
+    // the repeat frame before still waits for the transmitter: one send for both, the slot stays free for a new key
+    if (repeat && Rxframes && !Rxq[Rxhead ? Rxhead-1 : RXSLOTS-1].bits) Errors++;
+
+    if (!Errors) // queue the frame
+    {
+        if (++Rxhead >= RXSLOTS) Rxhead=0;
+        Rxframes++;
     }
 
+    PRF_STOP(PRF_EOT,teot);
     //reset capture system after timeout
     set_receiver();
+}
+
+/* process the oldest frame of the receive queue. Called from the main loop (service, learncode).
+- decode it into CS and free its slot
+if valid,
+	- in learnmode: flag Gotcode for learncode. A frame that does not decode is taken as waveform,
+	  if the capture isr recorded it in Rawbuf (CS.bits = BITS_RAW, see rawstep)
+	- else find translate code in table
+	if found
+		- set up and start the transmitter, reception continues meanwhile
+A repeat frame of a held key sends the last translation again, without findcode() and setuptx().
+A new frame is not processed while transmitting, it stays queued.
+returns: 1=a frame was processed; 0=nothing to do
+*/
+BYTE doframe(void)
+{
+    BYTE ret, repeat, raw = 0;
+
+    if (Txbusy || !Rxframes) return 0;
+
+#ifdef WAVEFORM
+    raw = (Rawq == Rxtail+1) && Learnbut; // its waveform is in Rawbuf
+    if (Rawq == Rxtail+1) Rawq = 0;
+#endif
+    repeat = !raw && !Rxq[Rxtail].bits; // repeat frame of a held key, see isrepeat()
+    PRF_START(tdec);
+    ret = repeat ? 1 : decodeframe(&Rxq[Rxtail]); // most of the decode was done by the capture isr
+    PRF_STOP(PRF_DECODE,tdec);
+    TR(trframe(&Rxq[Rxtail], (repeat ? TF_REPEAT : ret ? TF_ERR : 0) | (raw ? TF_RAW : 0) | (Learnbut ? TF_LEARN : 0)));
+
+    cli(); // free the slot, Rxframes is shared with the isr
+    if (++Rxtail >= RXSLOTS) Rxtail=0;
+    Rxframes--;
+    if (Rxframes == RXSLOTS-1) set_receiver(); // was full, receiver was stopped
+    sei();
+
+    if (repeat && !Learnbut && Repsync1) // send the last translation again, the transmitter is still set up
+    {
+        cli();
+        set_transmitter(1);
+        sei();
+        TR(trlookup(0,TL_REPEAT|TL_TX,hal_timer1()));
+        return 1;
+    }
+    if (ret && !raw) return 1; // invalid frame
+    if (ret) CS.bits = BITS_RAW; // learnmode only
+
+    Repsync1=0; // a new key, no repeats until it is translated
+    if (Debug==1) hal_led_toggle(); // toggle LED on every code received
 
+    if (!Learnbut) // dont translate in learnmode!
+    {
+        if ((Debug==3)&&(CS.bits==32)) hal_led_toggle(); // toggle LED on 32bit code received
+        if ((Debug==4)&&(CS.bits==16)) hal_led_toggle(); // toggle LED on 32bit code received
 
+        PRF_START(tfind);
+        BYTE found = 0;
+        TR(BYTE trf = TL_CACHE);
+        if (!(PCS = findcache())) // repeated key: the record is in RAM, no flash access
+        {
+            TR(trf = 0);
+            found = findcode();
+            if (!found)
+            {
+                addcache();
+                addprofile(); // the next frames of this remote end early
+            }
+        }
+        PRF_STOP(PRF_LOOKUP,tfind);
+        TR(WORD tfound = hal_timer1());
+        if (!found) // if found translate code
+        {
+            if (Debug==2) hal_led_toggle(); // toggle LED on code compare match
+
+            Repsync1 = CS.sync1; // the signature of the repeat frames of this key
+            Repsync2 = CS.sync2;
+            PRF_START(tset);
+            setuptx();
+            PRF_STOP(PRF_TXSETUP,tset);
+            if (PCS) Repsync1=0; // chain, the transmitter holds only its current record
+            cli();
+            set_transmitter(0);
+            sei();
+            TR(trlookup(found,trf|TL_TX,tfound));
+            return 1;
+        }
+        TR(trlookup(found,trf,tfound));
+    }
+    Gotcode++; // flag reception OK, valid code in CS. used for learncode
+    return 1;
 }
 
-// the "learncode" key was pressed
+// the "learncode" key was pressed: debounce it in the UI tick
 ISR(INT1_vect)
 {
-
-    waitlong(); // debounce time
-    Learnbut++; // signal button pressed
-//bset(INTF1,EIFR); // clear int flag if double set
+    hal_wake_disarm(); // if it woke us from power-down
+    hal_button_stop(); // no more interrupts of the bouncing contact
+    Butlevel = 1;
+    Butcnt = UI_DEBOUNCE;
+    ui_start();
 }
 
 
-/* write SPM_PAGESIZE Bytes to flash (one page!):
-
-NOTE: The SELFPRGEN Fuse Bit must be programmed, otherwise you cannot write to flash !!!!
-	  BLB0,1,2 Fuses may need to be set to "SPM no restriction" on some AVR processors.
+#if defined(PROFILE) || defined(PROVISION)
+// the profiler commands on serial: 'p' = dump, 'r' = reset. And the requests of the table protocol
+ISR(USART_RX_vect)
+{
+    BYTE c = hal_uart_rx();
 
-The addressable flash region shall be after the code!! Set MAXPAGE,MINPAGE accordingly in define above.
-entry:
-- page = pagenumber from MINPAGE to MAXPAGE(inclusive)
-- *buf = pointer to sourcebuffer(RAM) containing the SPM_PAGESIZE-Bytes to write.
+#ifdef PROVISION
+    if (pvbyte(c)) return;
+#endif
+#ifdef PROFILE
+    Prfcmd = c;
+#endif
+}
+#endif
 
-The addressed page is erased, then SPM_PAGESIZE Bytes are written to the flash.
+#ifdef PROFILE
 
-For Atmega48: flashsize=2048-words or 4096-Bytes. SPM_PAGESIZE is 32Words or 64Bytes, Number of pages=64 or 0 - 63
-No special Bootsection is present, so SPM can be executed anywhere by default.
-If Processor has a Boot-section, check BLB0,1,2 Fuses.
-*/
-void flash_write_page (uint32_t page, uint8_t *buf)
+// add the time since t0 to the statistics of phase
+void prf_add(BYTE phase, WORD t0)
 {
-    uint16_t i;
-    uint8_t sreg;
+    WORD t = hal_ticks() - t0;
+    struct prf *p = &Prf[phase];
+    BYTE b;
+
+    if (!p->cnt || t < p->min) p->min = t;
+    if (t > p->max) p->max = t;
+    if (p->cnt < 0xffff) p->cnt++;
+    for (b=0, t>>=5; t && b<(PRF_BINS-1); b++) t>>=1; // log2 bins
+    if (p->bin[b] < 0xffff) p->bin[b]++;
+}
 
-    if ((page > MAXPAGE) || (page < MINPAGE)) return; // page number out of range
-    page *= SPM_PAGESIZE; // convert pagenumber to actual start-address of the page in flash !!!!
+// called from the main loop, not from interrupt: printing takes long. The text is in flash, no RAM buffer
+void prf_dump(void)
+{
+    static const char names[PRF_N][7] PROGMEM = { "eot", "decode", "lookup", "txset" };
+    BYTE i,b;
 
-    sreg = SREG; // save status register for later restore (simulate an interrupt)
-    cli(); // Disable interrupts.
-    eeprom_busy_wait (); // wait possible eeprom action, this will corrupt flashing.
+    if (Prfcmd == 'r')
+    {
+        memset(Prf,0,sizeof(Prf));
+        memset(Rejects,0,sizeof(Rejects));
+    }
+    if (Prfcmd == 'p')
+    {
+        putsp(PSTR("\nphase cnt min max us: <32 <64 <128 <256 <512 <1k <2k >=2k\n"));
+        for (i=0; i<PRF_N; i++)
+        {
+            putsp(names[i]);
+            putdec(Prf[i].cnt);
+            putdec(Prf[i].min);
+            putdec(Prf[i].max);
+            putcc(':');
+            for (b=0; b<PRF_BINS; b++) putdec(Prf[i].bin[b]);
+            putcc('\n');
+        }
+        putsp(PSTR("noise sync"));
+        putdec(Rejects[NZ_SYNC]);
+        putsp(PSTR(" short"));
+        putdec(Rejects[NZ_SHORT]);
+        putsp(PSTR(" long"));
+        putdec(Rejects[NZ_LONG]);
+        putcc('\n');
+    }
+    Prfcmd = 0;
+}
 
-    boot_page_erase (page); // erase the destination page
-    boot_spm_busy_wait ();      // Wait until page is erased.
+// a string in flash (PSTR)
+void putsp(const char *ps)
+{
+    char c;
 
-    for (i=0; i<SPM_PAGESIZE; i+=2) // write your data to the special register-buffer,Z-pointer(this is NOT normal RAM!)
-    {
-        // the registerbuffer is WORD addressed and takes WORDs, so even amounts only.
-        uint16_t w = *buf++;
-        w += (*buf++) << 8; // little endian
+    while ((c = pgm_read_byte(ps++))) putcc(c);
+}
 
-        boot_page_fill (page + i, w); // write to register buffer one word
-    }
+// a blank and n in decimal
+void putdec(WORD n)
+{
+    char d[5];
+    BYTE i=0;
 
-    boot_page_write (page);     // flash the page from the registerbuffer.(internal algorithm)
-    boot_spm_busy_wait();       // Wait until flashing is finished.
+    putcc(' ');
+    do d[i++] = '0' + n%10; while (n /= 10);
+    while (i) putcc(d[--i]);
+}
+#endif
 
-//   boot_rww_enable (); // Reenable RWW-section. only when RWW-section is present!!
 
-    SREG = sreg; // restore the status register with possible int-enable flags
+#if defined(PROFILE) || defined(PROVISION)
+// serial io, waits for the uart
+void putcc(char c)
+{
+#ifndef HOSTED
+    TR(while (Trtail != Trhead)); // the trace goes first. the simulator sends it in the background
+#endif
+    while(!hal_uart_txready()); // wait tx empty
+    hal_uart_tx(c);
 }
+#endif
+
+
+// crc16 xmodem (polynom 0x1021, start 0) of the table protocol. A frame followed by its crc (MSB first) gives 0.
+WORD crc16(WORD crc, BYTE c)
+{
+    BYTE i;
 
-/* read SPM_PAGESIZE Bytes from flash(one page!):
-entry:
-- page = pagenumber from MINPAGE to MAXPAGE(inclusive)
-- *buf = pointer to destinationbuffer(RAM) receiving the SPM_PAGESIZE-Bytes.
+    crc ^= (WORD)c << 8;
+    for (i=0; i<8; i++) crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    return crc;
+}
 
-No Bootsection restrictions!
 
+#ifdef PROVISION
+/* Table provisioning with host/irtable (see PV_SYNC): the uart receive isr collects a request (pvbyte),
+the data of a page to write goes straight into flashbuf. The main loop answers it (pvserve).
+PV_BEGIN waits for the transmitter, then translation, learning and table jobs stop until PV_COMMIT, so
+flashbuf belongs to the protocol. PV_COMMIT rebuilds the RAM copies and the directory of the new table.
+A power loss before PV_COMMIT rebuilds the directory at power on, from the pages written so far.
+A Byte on RXD wakes the cpu from power-down, that Byte is lost: the host repeats a request without reply.
 */
-void flash_read_page (uint32_t page, uint8_t *buf)
+// a Byte of a request, in the uart receive isr. returns 0 if it is not part of one
+BYTE pvbyte(BYTE c)
 {
+    BYTE len;
 
-    uint8_t sreg;
+    if (Pvready) return 1; // the host waits for the reply before it sends
+    if (!Pvpos)
+    {
+        if (c != PV_SYNC) return 0;
+        Pvcrc = 0;
+        Pvpos = 1;
+        return 1;
+    }
+    Pvcrc = crc16(Pvcrc,c);
+    if (Pvpos == 1) Pvcmd = c;
+    else if (Pvpos == 2) Pvpage = c;
+    len = (Pvcmd == PV_WRITE) ? SPM_PAGESIZE : 0;
+    if ((Pvpos >= 3) && (Pvpos < 3+len) && Prov) flashbuf[Pvpos-3] = c; // not while the main loop uses it
+    if (++Pvpos == 5+len) // with the crc
+    {
+        Pvpos = 0;
+        Pvready = 1;
+    }
+    return 1;
+}
 
-    if ((page > MAXPAGE) || (page < MINPAGE)) return; // page number out of range
-    page *= SPM_PAGESIZE;
+static WORD Pvout; // crc of the reply
 
-    sreg = SREG; // save status register for later restore
-    cli(); // Disable interrupts.
+static void pvput(BYTE c)
+{
+    putcc(c);
+    Pvout = crc16(Pvout,c);
+}
 
-    //void * memcpy_P( void *dest, const void *src, size_t n )
-    //The memcpy_P() function returns a pointer to dest or 0 on error
-    memcpy_P(buf, (const void*)(uintptr_t)(page), SPM_PAGESIZE); // copy data from flash to buffer using the clib function in pgmspace.h
+// execute the request and send the reply, in the main loop
+void pvserve(void)
+{
+    BYTE st = PV_OK, len = 0, i;
 
-    SREG = sreg; // restore the status register with possible int-enable flags
+    Page = 0; // flashbuf is used by the protocol
+    if (Pvcrc) st = PV_ECRC;
+    else if (Pvcmd == PV_INFO)
+    {
+        flashbuf[0] = MINPAGE;
+        flashbuf[1] = MAXPAGE;
+        flashbuf[2] = SPM_PAGESIZE;
+        memcpy(flashbuf+3,Rejects,sizeof(Rejects));
+        len = 3+sizeof(Rejects);
+    }
+    else if (Pvcmd == PV_BEGIN)
+    {
+        if (Txbusy || Learnbut) st = PV_EBUSY;
+        else
+        {
+            Prov = 1;
+            Job = 0; // the whole table is written over
+            hal_ee_write(EE_MAGIC, 0); // rebuild the directory at power on
+        }
+    }
+    else if (Pvcmd == PV_COMMIT)
+    {
+        if (!Prov) st = PV_ESEQ;
+        else
+        {
+            clearcache();
+            clearprofiles(); // of the remotes of the old table
+            Repsync1 = 0;
+            checkdir(); // timings, log and directory of the new table
+            Prov = 0;
+        }
+    }
+    else if ((Pvpage < MINPAGE) || (Pvpage > MAXPAGE)) st = PV_EPAGE;
+    else if (Pvcmd == PV_READ)
+    {
+        flash_read_page(Pvpage, flashbuf);
+        len = SPM_PAGESIZE;
+    }
+    else if (Pvcmd == PV_WRITE)
+    {
+        if (!Prov) st = PV_ESEQ;
+        else flash_write_page(Pvpage, flashbuf);
+    }
+    else st = PV_ECMD;
+
+    cli();
+    Pvawake = PV_AWAKE; // for the next request
+    ui_start();
+    sei();
+    putcc(PV_SYNC);
+    Pvout = 0;
+    pvput(Pvcmd);
+    pvput(st);
+    pvput(len);
+    for (i=0; i<len; i++) pvput(flashbuf[i]);
+    putcc(Pvout >> 8);
+    putcc(Pvout);
+    Pvready = 0;
 }
+#endif
 
 
 #ifdef DBPRINT
-// serial io: (uses a lot of codespace!)
+/* trace of the frame in receive slot f, after its decode into CS. Called by doframe() for every queued frame,
+before its slot is freed. The durations are up to the EOF in Trraw, if they were recorded for this slot.
+Trraw is free for the next frame then.
+*/
+void trframe(struct rxframe *f, BYTE flags)
+{
+    struct trframe t;
+    BYTE n = 1;
 
+    if (Trslot == f-Rxq+1)
+    {
+        while ((n<IOSIZE) && Trraw[n]) n++; // up to the EOF
+    }
+    else flags |= TF_NODUR;
+    t.lost = Trlost;
+    t.flags = flags;
+    t.teot = f->teot;
+    t.tdec = hal_timer1();
+    t.code = CS.sendcode;
+    memcpy(&t.timing,&CS.sync1,sizeof(struct irtiming));
+    if (trbegin(TR_FRAME,sizeof(t)+n-1))
+    {
+        trdata(&t,sizeof(t));
+        trdata(Trraw+1,n-1);
+        trend();
+    }
+    if (!(flags & TF_NODUR)) Trslot = 0; // the capture isr may take Trraw
+}
 
-void printdb(void)
+// trace of the lookup of CS: the findcode() result and the record found (Rec)
+void trlookup(BYTE found, BYTE flags, WORD tfind)
 {
-    //debug
-    sprintf(sbuf,"\n\nCapcnt:%u Code:0x%08lx s1:%u s2:%u ",Capcnt,CS.sendcode,CS.sync1,CS.sync2);
-    putss(sbuf);
-    sprintf(sbuf,"stoplen:%u timshort:%u timlong:%u cod:%u bits:%u\n",CS.stoplen,CS.timshort,CS.timlong,CS.coding,CS.bits);
-    putss(sbuf);
-    BYTE i;
-    for (i=0; i<Capcnt; i++)
+    struct trlookup t;
+
+    t.lost = Trlost;
+    t.flags = flags;
+    t.found = found;
+    t.rec = Rec;
+    t.tfind = tfind;
+    t.ttx = hal_timer1();
+    if (!trbegin(TR_LOOKUP,sizeof(t))) return;
+    trdata(&t,sizeof(t));
+    trend();
+}
+
+/* start a trace record with len payload Bytes. Not in interrupt, the ring has a single writer.
+returns 0 if the record does not fit into the ring, it is dropped then without waiting.
+*/
+BYTE trbegin(BYTE type, BYTE len)
+{
+    BYTE h[3] = { TR_SYNC, type, len };
+
+    if ((BYTE)((Trtail - Trhead - 1) & (TRSIZE-1)) < len+4) // sync, type, length, sum
     {
-        sprintf(sbuf," %u",iobuf[i]);
-        putss(sbuf);
+        if (Trlost < 0xff) Trlost++;
+        return 0;
     }
+    trdata(h,3);
+    Trsum = type + len; // the sum starts behind the sync
+    return 1;
 }
 
+void trdata(const void *p, BYTE n)
+{
+    const BYTE *b = p;
 
+    while (n--)
+    {
+        Trsum += *b;
+        Trbuf[Trhead] = *b++;
+        Trhead = (Trhead+1) & (TRSIZE-1);
+    }
+}
 
-void putcc(char c)
+// finish the record with its sum and let the uart send it
+void trend(void)
 {
-    while(!btst(UDRE0,UCSR0A)); // wait tx empty
-    UDR0 = c;
+    BYTE sum = Trsum;
+
+    trdata(&sum,1);
+    Trlost = 0;
+    hal_uart_txint_on();
 }
 
-void putss(char *ps)
+// the uart data register is empty: send the next Byte of the trace
+ISR(USART_UDRE_vect)
 {
-    while (*ps) putcc(*ps++);
+    if (Trtail == Trhead) // all sent, wait for the last Byte to leave the shift register (see deepsleep)
+    {
+        hal_uart_txint_off();
+        hal_uart_txc_on();
+        return;
+    }
+    hal_uart_tx(Trbuf[Trtail]);
+    Trtail = (Trtail+1) & (TRSIZE-1);
 }
 
-
-char getcc(void)
+ISR(USART_TX_vect)
 {
-    if (btst(RXC0,UCSR0A))
-        return(UDR0);
-    else return(0);
+    hal_uart_txc_off();
 }
-
 #endif
\ No newline at end of file
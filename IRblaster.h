@@ -0,0 +1,557 @@
+/*
+ AVR IR Blaster. Infrared Remote Control Translater and Blaster.
+ Shared declarations of the decode/lookup/transmit core.
+ Included by the firmware (IRblaster.c) and by the hosted Linux build in host/.
+
+ Copyright Thomas Krueger, Hofgeismar, Germany
+ December 2019
+ */
+
+#ifndef IRBLASTER_H
+#define IRBLASTER_H
+
+#include <stdint.h>
+#include <stddef.h> // offsetof
+
+// ++++++++++++++++++++++++ DEFINES +++++++++++++++++++++++++++++++++++
+#define BYTE unsigned char
+#define WORD unsigned short
+#define ULONG uint32_t // 32bit, also on the host where unsigned long is 64bit
+
+// Macros: Bit operations on byte/word/long variables. Format: bset(Bit,variable). works also on SFRs(creates sbi,cbi)
+#define bset(x,y) (y |= (1 << x))
+#define bclr(x,y) (y &= (~(1 << x)))
+#define btst(x,y) (y & (1 << x))
+#define PACKED __attribute__((packed)) // flash layout, no padding on the host either
+
+#include "hal.h"
+
+/* Code table: TABPAGES pages at the end of the application flash, the section "codetable" (Codetable in hal_avr.c).
+The Makefile sets TABPAGES per MCU_TARGET and places the section (--section-start), the linker fails the build
+if the code or its data reach it. MINPAGE and MAXPAGE come from its start and end symbols, see hal_init().
+SPM_PAGESIZE the processors pagesize is defined in the processor file, 64 Bytes on the atmega48pa, 128 on the atmega168 and atmega328p.
+The hosted build emulates the table of MCU_TARGET (TABSTART, SPM_PAGESIZE and EESIZE from the Makefile).
+*/
+#ifndef TABPAGES
+#define TABPAGES 72 // atmega328p: pages 180..251, 0x5A00..0x7DFF
+#endif
+#ifdef HOSTED
+#ifndef TABSTART
+#define TABSTART 0x5A00
+#endif
+#define MINPAGE (TABSTART/SPM_PAGESIZE)
+#define MAXPAGE (MINPAGE+TABPAGES-1)
+#else
+#define MINPAGE Minpage
+#define MAXPAGE Maxpage
+#endif
+#define TABPAGE (MINPAGE+1) // first page of records, MINPAGE is the header with the timing dictionary
+
+
+//#define DBPRINT   // binary trace of the frames on serial, decode it with host/irtrace. saves a lot of space if off!!
+//#define PROFILE   // ISR cycle profiler: timestamps decode, lookup and transmit setup. send 'p' on serial to dump, 'r' to reset.
+//#define PROVISION // table backup/restore over serial with host/irtable, see pvserve()
+
+// features that cost flash, the Makefile sets them per MCU_TARGET (FEATURES), make size shows what they take:
+//#define WAVEFORM  // learn codes the decoder cannot read (biphase, more than 32 Bits) as waveform records, see rawstep()
+//#define COMPACT   // reuse the slots of deleted records by compaction, see compact(). else only an erase (menu 4) frees them
+//#define CACHE     // hot translation cache in RAM, see findcache(). else every key reads the directory and flash
+//#define RXPROF    // receive profiles, a frame of a known remote ends at its stoplen, see endprofile(). else by the timeout
+
+
+#define IOSIZE 70 // max durations of a received frame
+#define RXMIN 5 // 200us: durations below the shortest Bit of any protocol (and 0) are noise, see noise()
+#define RXSYNCMIN 18 // 720us: below the shortest sync1 of the decoded protocols (Sony 2.4ms, Samsung 4.5ms), the first
+                     // Mark of a burst of noise is shorter. Not when learning a waveform, see rxedge()
+enum { NZ_SYNC, NZ_SHORT, NZ_LONG, NZ_N }; // reasons of a rejected burst: sync1 implausible, duration < RXMIN, > 10.2ms
+#define RXSLOTS 3 // frames in the receive queue, sizeof(struct rxframe) Bytes RAM each
+#if SPM_PAGESIZE > 64
+#define CACHESIZE 8 // records in the hot translation cache, 16 Bytes RAM each. also Rawbuf, RAWSYM+RAWMAX/2 Bytes
+#else
+#define CACHESIZE 5 // records in the hot translation cache, 16 Bytes RAM each. also Rawbuf, RAWSYM+RAWMAX/2 Bytes
+#endif
+
+// transmitter: index of the periods in Txdur, see setuptx()
+#define TX_SYNC1 0
+#define TX_SYNC2 1
+#define TX_BITS 2 // also the index of the first Bit pair in the record
+#define TX_ZERO 2
+#define TX_ONE1 3
+#define TX_ONE2 4
+#define TX_STOP 5
+
+// a complete record, in RAM: received code (CS), found translation (Tr), cache
+struct ircode
+{
+    ULONG comparecode; // the code we received from remote control or 0xffffffff as end of table. Or 0 for invalid/followon code,
+    ULONG sendcode;  // the code we send out as translation, the spec follows below
+    BYTE sync1;		// synclength1. we always assume to have sync1 and sync2
+    BYTE sync2;		// synclength2
+    BYTE stoplen; // if 0, no stoplen
+    BYTE timshort; //puls duration 0 Bit. timshort + timshort = 0
+    BYTE timlong;  //puls duration 1 Bit. timshort + timlong = 1
+    BYTE coding;   //1Bit-coding scheme: 0=short/long;1=long/short. And how it is sent: TC_REPEAT, TC_GAP
+    BYTE bits; // number of Bits in code to transmit, BITS_RAW = waveform record
+    BYTE next; // followon code. if 0xAA, then the next record in the table will be send also.(fe. to power multible devices on/off).
+};
+
+// a received frame, decoded by the capture isr while it arrives. see rxstep()
+struct rxframe
+{
+    ULONG code;  // received Bits, shifted in from the top
+    WORD al;     // sum of the 0-Bit durations. until the first 0-Bit the short halves of the 1-Bits, twice
+    WORD ah;     // sum of the 1-Bit durations
+    BYTE lc;     // 0-Bit count
+    BYTE hc;     // 1-Bit count
+    BYTE cod0;   // 1-Bits coded long-short
+    BYTE cod1;   // 1-Bits coded short-long
+    BYTE bits;
+    BYTE sync1;
+    BYTE sync2;
+    BYTE w1;     // first duration of the current Bit pair, after the frame the stoplen
+    BYTE l1;     // long half of the first 1-Bit
+    BYTE err;    // 1: more than 32 Bits, 2: 1-Bits of different length before the first 0-Bit
+#ifdef DBPRINT
+    WORD teot;   // Timer1 at the end of the frame, for the trace
+#endif
+};
+
+// timing of a send code, the fields sync1..bits of struct ircode
+struct irtiming
+{
+    BYTE sync1;
+    BYTE sync2;
+    BYTE stoplen;
+    BYTE timshort;
+    BYTE timlong;
+    BYTE coding; // TC_CODING, TC_REPEAT, TC_GAP
+    BYTE bits; // 0xff = free entry
+};
+#define TC_CODING 0x01 // 1Bit-coding scheme
+#define TC_REPEAT 0x06 // the record is sent 1+n times (Bits 1,2)
+#define TC_GAP 0xf8 // pause before each send in GAPUNIT ms (Bits 3..7), 0 = 65ms
+#define GAPUNIT 8
+#define TXSTEP 60 // ms, a longer pause is waited in Timer1 periods of this length. see txgap()
+#define TXREPGAP 30 // ms, the most pause before the send for a repeat frame. NEC repeats every 108ms, see set_transmitter()
+
+#define TIMINGS 8 // timing dictionary entries in the header page, 7 Bytes RAM each
+#define TABMAGIC 0x31544952L // header page of the table format with timing dictionary
+struct tablehead // page MINPAGE
+{
+    ULONG magic;
+    struct irtiming timing[TIMINGS];
+} PACKED;
+
+// a record in flash, RECPERPAGE per page (7 in 64 Bytes)
+struct irrec
+{
+    ULONG comparecode; // as struct ircode
+    ULONG sendcode;
+    BYTE timing; // index into the timing dictionary, REC_NEXT for a followon record
+} PACKED;
+#define REC_TIMING 0x07 // TIMINGS-1
+#define REC_DATA 0x20 // data slot of a waveform record
+#define REC_RAW 0x40 // waveform record, its sendcode is a struct rawhead
+#define REC_NEXT 0x80 // next=0xAA in struct ircode
+
+/* waveform record: a code the pulse distance decoder cannot represent (biphase, more than 32 Bits),
+stored as its durations. The head slot holds the comparecode and this header as sendcode,
+the data follows in the next slots: the symbols (distinct durations, 40us units), then a symbol index
+of 1, 2 or 4 Bits per duration. RAWPERSLOT Bytes per data slot, in its sendcode. see rawpack()
+*/
+struct rawhead
+{
+    BYTE durs;  // durations, Mark first
+    BYTE nsym;  // symbols
+    BYTE bits;  // Bits per index
+    BYTE slots; // data slots behind the head
+};
+#define BITS_RAW 0xff // struct ircode of a waveform record
+#define RAWSYM 16 // max symbols, Rawbuf[0..RAWSYM-1] while capturing, the 4bit indices behind
+#define RAWMAX 104 // max durations, the packed data must fit into RAWSLOTS
+#define RAWMIN 8 // min durations of a waveform
+#define RAWPERSLOT 4 // data Bytes per slot, the comparecode is 0 (followon record)
+#define RAWSLOTS ((RAWSYM + RAWMAX/2 + RAWPERSLOT-1) / RAWPERSLOT) // max data slots
+#define RAWBAD 0xff // Rawn: no waveform captured
+
+#ifdef WAVEFORM
+#define TXDUR RAWSYM // Txdur: the symbols of a waveform
+#else
+#define TXDUR (TX_STOP+1)
+#endif
+
+#define RECSIZE 9 // sizeof(struct irrec), for #if
+#define RECPERPAGE (SPM_PAGESIZE / RECSIZE) // records per flash page
+#define LOGPAGES (TABPAGES-1) // record pages, used as a log
+#define RECORDS (LOGPAGES*RECPERPAGE) // size of the code table in record slots
+#if RECORDS > 255
+#define SLOT WORD // index of a record slot
+#define SLOTBYTES 2
+#else
+#define SLOT BYTE
+#define SLOTBYTES 1
+#endif
+_Static_assert(sizeof(struct irrec) == RECSIZE, "RECSIZE");
+#ifdef COMPACT
+#define RESERVE (RECPERPAGE+3) // free slots kept for a compaction step (a page and the rest of a chain)
+#define RAWRESERVE (RESERVE+RAWSLOTS) // the same if the log holds waveform records, see reserve()
+#define COMPACTAT (reserve()+RECPERPAGE) // compact in the background when less slots are free
+#else
+#define RESERVE 1 // Head never reaches the Tail page
+#define RAWRESERVE RESERVE
+#endif
+#define JOB_ERASE 1 // table jobs, see jobstep()
+#define JOB_COMPACT 2
+
+// EEPROM: hashed directory of the code table, see findcode() and checkdir()
+#define EE_MAGIC 0 // DIRMAGIC if the directory is valid
+#define EE_HEAD  1 // Head of the log = slot after the last record, SLOTBYTES
+#define EE_PROBE (EE_HEAD+SLOTBYTES) // the furthest entry from its home, see dirfind()
+#define EE_PROF  (EE_PROBE+1) // receive profiles, NPROF * struct rxprof
+#define EE_DIR   (EE_PROF+NPROF*4) // the rest: DIRSIZE entries of 2 Bytes, see dirkey()
+#define DIRSIZE  ((EESIZE-EE_DIR)/2)
+#define DIRMAGIC 0xA6
+#define FPMAGIC 0xA5 // the fingerprint directory of an older firmware, the profiles were behind it
+#define ERASEMAGIC 0x5A // table erase in progress, see starterase()
+#define DIREMPTY 0xffff // erased eeprom
+#define DIRPROBE 32 // a new code is not learned (table full) if no entry this close to its home is free
+#define DIRCLEAR 8 // directory entries a step of the erase job clears, see jobstep()
+#if RECORDS < 256 // slot in the low Bits of an entry, a fingerprint of the code above
+#define DIRBITS 8
+#elif RECORDS < 512
+#define DIRBITS 9
+#elif RECORDS < 1024
+#define DIRBITS 10
+#else
+#error "more than 1023 record slots, TABPAGES too big for the directory"
+#endif
+#define DIRSLOT(e) ((e) & ((1<<DIRBITS)-1))
+
+// learn menu states, see learncode()
+#define LS_MENU 0 // a remote key selects the menu item (Learnbut)
+#define LS_S 1 // wait for the code S
+#define LS_D 2 // wait for the codes D
+#define LS_ERASE 3 // wait for a different key to confirm the erase
+#define LS_DELETE 4 // wait for the code S to delete
+
+// UI tick, see ui_blink()
+#define UITICK 10000 // us, 10ms
+#define UI_ON 10 // ticks the LED is on per blink
+#define UI_OFF 20 // ticks off between blinks
+#define UI_PAUSE 40 // ticks off after the last blink
+#define UI_DEBOUNCE 3 // ticks the button must be stable
+
+#ifdef RXPROF
+#define NPROF 4 // receive profiles, 4 Bytes RAM each
+#else
+#define NPROF 0
+#endif
+#if DIRSIZE < 32
+#error "no room for the directory in the eeprom"
+#endif
+
+// what a received frame of a remote in the table looks like, see endprofile()
+struct rxprof
+{
+    BYTE sync1;
+    BYTE sync2;
+    BYTE bits;
+    BYTE stoplen;
+};
+
+
+
+// globals:
+extern struct rxframe Rxq[RXSLOTS]; // receive queue of frames decoded while captured, see doframe()
+extern struct rxframe *Rx; // slot the capture isr decodes into
+extern BYTE Rxhead;
+extern BYTE Rxtail;
+extern BYTE Rxframes; // number of queued frames
+extern BYTE Txbusy; // flag, transmitter running
+extern BYTE Txcnt;
+extern BYTE Txon; // flag, a record is being sent
+extern BYTE Txdur[TXDUR]; // periods of the record being sent in 40us units, see setuptx()
+extern ULONG Txsend;
+extern ULONG Txcode;
+extern BYTE Txend;
+extern BYTE Txone;
+extern BYTE Txgap; // ms pause before each send, see txgap()
+extern BYTE Txwait;
+extern BYTE Txrepeat;
+extern BYTE Txrep;
+#ifdef WAVEFORM
+extern BYTE Txraw; // waveform record: durations to send, see rawnext()
+extern BYTE Rawbits;
+extern BYTE Rawsym;
+extern SLOT Rawdata;
+extern BYTE Rawpos;
+extern BYTE Rawleft;
+extern BYTE Rawbyte;
+extern BYTE Rawhave;
+extern BYTE Rawon; // learnmode: waveform capture into Rawbuf armed, see rawstep()
+extern BYTE Rawn;
+extern BYTE Rawq;
+#endif
+extern BYTE flashbuf[SPM_PAGESIZE]; // used for flash io
+extern WORD Lastcap;
+extern BYTE Capcnt;
+extern BYTE Errors;
+extern BYTE Noise; // flag, a burst of noise is being ignored, see noise()
+extern WORD Rejects[NZ_N]; // rejected bursts by reason, saturating
+extern BYTE Learnbut; // presses of the "learnbutton", if set we are in learnmode
+extern BYTE Gotcode; // flag, if set, we received a valid ir code in CS.
+extern BYTE Learnstate; // learn menu state machine, see learncode()
+extern BYTE Menue;
+extern BYTE Nchain;
+extern ULONG CodeS;
+extern struct irrec Chain[3];
+extern BYTE Blinks; // UI: LED pattern and button debounce, see ui_blink()
+extern BYTE Blinkrep;
+extern BYTE Blinkph;
+extern BYTE Uitime;
+extern BYTE Butcnt;
+extern BYTE Butlevel;
+extern BYTE Butdown;
+extern BYTE Page; // flashpage of data in flashbuf, set by findcode()
+extern SLOT Rec; // slot of the record in Tr
+extern SLOT Head; // log: next free slot
+extern BYTE Tail; // log: oldest page
+extern SLOT Live; // live records in the log
+extern BYTE Rawrecs; // live waveform records
+extern BYTE Job; // background table job
+extern BYTE Jobpage;
+extern WORD Jobent;
+extern WORD Dirhome; // home entry of the code of dirkey()
+extern BYTE Debug; // if set, toggles the LED each time a vilad code is received.
+extern struct ircode CS, *PCS; // PCS global pointer to current record (Tr or a cache entry), set by findcode(). CS is used for reception.
+extern struct ircode Tr; // record of the table found by findcode()
+extern struct irtiming Timings[TIMINGS]; // timing dictionary
+extern struct ircode Cache[CACHESIZE]; // hot translation cache, see findcache()
+#define Rawbuf ((BYTE*)Cache) // the cache RAM while it is not used: waveform capture in learnmode
+#ifdef CACHE
+extern BYTE Cachenext;
+#endif
+#ifdef RXPROF
+extern struct rxprof Prof[NPROF];
+extern BYTE Profnext;
+#endif
+extern BYTE Repsync1; // sync of the last translated frame, for its repeat frames. 0 = none
+extern BYTE Repsync2;
+
+
+//protos:
+void flash_read_page (uint32_t page, uint8_t *buf);
+void flash_write_page (uint32_t page, uint8_t *buf);
+void flash_erase_page (uint32_t page);
+void flash_program_page (uint32_t page, uint8_t *buf);
+void set_receiver(void);
+void set_transmitter(BYTE repeat);
+void service(void);
+BYTE deepsleep(void);
+void rxedge(WORD cnt);
+BYTE doframe(void);
+void rxstep(struct rxframe *f, BYTE n, BYTE d);
+BYTE decodeframe(struct rxframe *f);
+void endframe(void);
+void noise(BYTE why);
+BYTE isrepeat(struct rxframe *f);
+#ifdef RXPROF
+BYTE endprofile(struct rxframe *f);
+void addprofile(void);
+void loadprofiles(void);
+void clearprofiles(void);
+#else
+#define endprofile(f) 0 // every frame ends by the timeout
+#define addprofile()
+#define loadprofiles()
+#define clearprofiles()
+#endif
+#ifdef HOSTED
+BYTE decodebuf(BYTE *buf);
+#endif
+void setuptx(void);
+WORD txnext(void);
+WORD txgap(void);
+WORD txwait(void);
+BYTE rawslots(ULONG sendcode);
+#ifdef WAVEFORM
+void rawsetup(void);
+void rawrewind(void);
+WORD rawnext(void);
+BYTE rawbyte(BYTE n);
+void rawstep(WORD d);
+ULONG rawpack(void);
+#define WF(x) x // a statement of the waveform records
+#else
+#define WF(x)
+#endif
+BYTE findcode( void);
+struct irrec *slotrec(SLOT s);
+void loadrec(SLOT i);
+SLOT nextslot(SLOT s);
+SLOT used(void);
+SLOT avail(void);
+BYTE reserve(void);
+BYTE storecode(void);
+BYTE storechain(struct irrec *r, BYTE n, BYTE *raw);
+void append(struct irrec *r);
+void killrec(SLOT s);
+BYTE compact(void);
+BYTE makeroom(BYTE n);
+BYTE jobstep(void);
+void starterase(void);
+void findlog(void);
+SLOT dirhead(void);
+void setdirhead(void);
+BYTE inlog(SLOT s);
+WORD dirkey(ULONG code);
+WORD dirget(WORD i);
+void dirput(WORD i, WORD e);
+WORD dirfind(ULONG code, SLOT s);
+WORD dirfree(ULONG code, BYTE limit);
+void dirset(WORD i, ULONG code, SLOT s);
+void dirremove(WORD i);
+BYTE dirbegin(void);
+BYTE blankpage(BYTE page);
+BYTE findtiming(struct ircode *r);
+void writehead(BYTE erase);
+void savehead(void);
+BYTE loadtimings(void);
+#ifdef CACHE
+struct ircode *findcache(void);
+void addcache(void);
+#else
+#define findcache() ((struct ircode*)0) // every key is looked up in the table
+#define addcache()
+#endif
+void clearcache(void);
+void checkdir(void);
+void learncode(void);
+void learnwait(BYTE st, BYTE cnt);
+void learnend(BYTE err);
+void ui_blink(BYTE cnt, BYTE repeat);
+void ui_start(void);
+
+#if defined(PROFILE) || defined(PROVISION)
+void putcc(char c);
+#endif
+#ifdef PROFILE
+void putsp(const char *ps);
+void putdec(WORD n);
+#endif
+WORD crc16(WORD crc, BYTE c);
+
+#ifdef PROFILE
+/* Profiler: duration of each phase in Timer1 ticks (1us = 8 cpu cycles).
+Histogram bin 0 counts <32us, bin n counts 2^(n+4) to 2^(n+5)-1 us, the last bin all above.
+Counters saturate at 0xffff.
+*/
+enum { PRF_EOT, PRF_DECODE, PRF_LOOKUP, PRF_TXSETUP, PRF_N }; // PRF_EOT = whole receive timeout isr
+#define PRF_BINS 8
+struct prf
+{
+    WORD cnt;
+    WORD min;
+    WORD max;
+    WORD bin[PRF_BINS];
+};
+extern struct prf Prf[PRF_N];
+extern BYTE Prfcmd; // command received on serial, handled in the main loop
+void prf_add(BYTE phase, WORD t0);
+void prf_dump(void);
+#define PRF_START(t0) WORD t0 = hal_ticks()
+#define PRF_STOP(phase,t0) prf_add(phase,t0)
+#else
+#define PRF_START(t0)
+#define PRF_STOP(phase,t0)
+#endif
+
+/* Binary trace (DBPRINT): a record per received frame and per lookup, written into a RAM ring that the
+uart data register empty interrupt sends. Tracing does not wait for the uart, so it does not change the timing.
+Record: TR_SYNC, type, payload length, payload, 8bit sum of type, length and payload.
+A record that does not fit into the ring is dropped, the next record counts it. Decoded by host/irtrace.
+The durations of a frame are recorded into Trraw by the capture isr, for one frame at a time: while it holds
+those of a queued frame not traced yet, the next frames are traced without (TF_NODUR).
+RAM: TRSIZE + IOSIZE + 5 Bytes, and 2 per receive slot. Too much for the 512 Bytes of the atmega48.
+*/
+#define TR_SYNC 0xA5
+#define TR_FRAME 'F' // struct trframe, then the durations
+#define TR_LOOKUP 'L' // struct trlookup
+#define TRSIZE 128 // Bytes RAM of the ring, a power of 2. holds a frame of IOSIZE durations
+#if defined(DBPRINT) && defined(RAMEND) && (RAMEND < 0x4FF)
+#error "DBPRINT needs more than 512 Bytes of RAM"
+#endif
+
+#define TF_ERR 0x01 // the frame did not decode
+#define TF_REPEAT 0x02 // repeat frame of a held key
+#define TF_RAW 0x04 // learnmode: its waveform is in Rawbuf, taken if the decode fails
+#define TF_LEARN 0x08 // received in learnmode
+#define TF_NODUR 0x10 // its durations were not recorded, Trraw held those of an earlier frame
+struct trframe
+{
+    BYTE lost;   // records dropped before this one
+    BYTE flags;  // TF_...
+    WORD teot;   // Timer1 (us) at the end of the frame
+    WORD tdec;   // Timer1 after the decode
+    ULONG code;  // the decoded frame (CS)
+    struct irtiming timing;
+    // the durations follow in 40us units, Capcnt-1 Bytes (the first edge measures nothing)
+} PACKED;
+
+#define TL_CACHE 0x01 // found in the cache
+#define TL_TX 0x02 // the transmitter started
+#define TL_REPEAT 0x04 // the last translation again, for a repeat frame
+struct trlookup
+{
+    BYTE lost;
+    BYTE flags;  // TL_...
+    BYTE found;  // findcode(): 0 = found, 1 = not found, 2 = table full
+    WORD rec;    // the record found
+    WORD tfind;  // Timer1 after the lookup
+    WORD ttx;    // Timer1 after the transmitter setup
+} PACKED;
+
+#ifdef DBPRINT
+extern BYTE Trbuf[TRSIZE];
+extern BYTE Trhead; // next Byte to write
+extern BYTE Trtail; // next Byte to send
+extern BYTE Trlost;
+extern BYTE Trraw[IOSIZE]; // durations of a frame for trframe(), up to 0
+extern BYTE Trslot; // receive slot+1 of the frame whose durations are in Trraw, 0 = none
+void trframe(struct rxframe *f, BYTE flags);
+void trlookup(BYTE found, BYTE flags, WORD tfind);
+BYTE trbegin(BYTE type, BYTE len);
+void trdata(const void *p, BYTE n);
+void trend(void);
+#define TR(x) x // a statement of the trace
+#else
+#define TR(x)
+#endif
+
+/* Table provisioning (PROVISION): dump, upload and verify the table pages MINPAGE..MAXPAGE over serial, 9600 8N1.
+Request: PV_SYNC, command, page, SPM_PAGESIZE data Bytes for PV_WRITE, crc16 of command..data (MSB first).
+Reply: PV_SYNC, command, status, length, data, crc16 of command..data. One request at a time, the host waits for the reply.
+*/
+#define PV_SYNC 0x5A
+#define PV_INFO 'I' // reply: MINPAGE, MAXPAGE, SPM_PAGESIZE, Rejects[] (LSB first)
+#define PV_READ 'R' // reply: the page
+#define PV_BEGIN 'B' // stop translating, the table is written over
+#define PV_WRITE 'W' // write the page, after PV_BEGIN
+#define PV_COMMIT 'C' // the new table is complete: rebuild the directory, translate again
+#define PV_OK 0
+#define PV_ECRC 1 // the request was damaged
+#define PV_EPAGE 2 // page out of range
+#define PV_ECMD 3 // unknown command
+#define PV_EBUSY 4 // transmitting or in learnmode, try again
+#define PV_ESEQ 5 // PV_WRITE or PV_COMMIT without PV_BEGIN
+#define PV_AWAKE 200 // UI ticks without power-down after a Byte woke us or a request, 2s
+
+#ifdef PROVISION
+extern BYTE Prov; // flag, between PV_BEGIN and PV_COMMIT
+extern BYTE Pvready; // a request is complete
+extern BYTE Pvawake; // UI ticks left without power-down
+BYTE pvbyte(BYTE c);
+void pvserve(void);
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ Hardware abstraction layer of the IR Blaster.
+ The core (IRblaster.c) only talks to timers, GPIO, uart and flash through these calls.
+
+ AVR build: every call is a macro on the SFRs, no call overhead in the ISRs.
+           Only hal_init() and the flash page routines are real functions (hal_avr.c).
+ HOSTED build (-DHOSTED): the calls operate on the simulated peripheral state "Hal" in host/hal_host.c,
+           and the flash table MINPAGE..MAXPAGE lives in RAM. Used to profile and test the core on Linux.
+
+ Peripherals used:
+ - Timer0: 38khz carrier on OC0A (PD6). Mark = COM0A0 set, Space = COM0A0 cleared.
+ - Timer1: 1Mhz free running timebase. Receive = input capture on ICP1 (PB0). Transmit = compare A,
+   both at the same time. Compare B is the 10ms UI tick (LED, button debounce), only while needed.
+ - Timer2: receive timeout, 8Mhz/1024. Overflows 15ms after the last capture (preset 135), 4ms in a burst of noise.
+ - PD2 status LED, PD3 learn button (INT1, low = pressed), UART 9600 Baud.
+ - Sleep: IDLE, or power-down when idle. Then the receiver wakes the cpu by pin change on PB0 (PCINT0),
+   the learn button by INT1 switched to low level (edges need the io clock). PRR stops the unused peripherals.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifndef HOSTED
+
+#include <io.h>
+#include <wdt.h>
+#include <sleep.h>
+#include <interrupt.h>
+#include <stdlib.h>
+#include <eeprom.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include <string.h>
+
+void hal_init(void); // setup of all ports and peripherals after reset
+extern BYTE Minpage; // the code table pages, from the linker symbols of its section, see Codetable
+extern BYTE Maxpage;
+#define EESIZE (E2END+1)
+
+// GPIO:
+#define hal_led_on()            bset(2,PORTD)
+#define hal_led_off()           bclr(2,PORTD)
+#define hal_led_toggle()        bset(2,PIND) // writing 1 to PINx toggles the port bit
+
+// learn button: INT1 on the falling edge, pullup
+#define hal_button()            (!btst(3,PIND)) // 1 = pressed
+#define hal_button_start()      do { EIFR = _BV(INTF1); bset(INT1,EIMSK); } while (0)
+#define hal_button_stop()       bclr(INT1,EIMSK)
+
+// IR output: 38khz carrier from Timer0 switched to PD6 or not
+#define hal_ir_mark()           bset(COM0A0,TCCR0A)
+#define hal_ir_space()          bclr(COM0A0,TCCR0A)
+
+// Timer1 is setup in hal_init(): normal 16bit up counter, noice-canceller, clocksource = systemclock/8
+
+// Timer1 receive: input capture, falling-edge first
+#define hal_capture_start()     do { bclr(ICES1,TCCR1B); TIFR1 = _BV(ICF1); bset(ICIE1,TIMSK1); } while (0)
+#define hal_capture_stop()      bclr(ICIE1,TIMSK1)
+#define hal_capture_running()   btst(ICIE1,TIMSK1)
+#define hal_capture_value()     ICR1
+#define hal_capture_toggle_edge() do { if (btst(ICES1,TCCR1B)) bclr(ICES1,TCCR1B); else bset(ICES1,TCCR1B); } while (0)
+
+// Timer1 transmit: compare match interrupt period us after now, then period us after the last match
+#define hal_compare_start(period) do { OCR1A = TCNT1 + (period); TIFR1 = _BV(OCF1A); bset(OCIE1A,TIMSK1); } while (0)
+#define hal_compare_period(period) (OCR1A += (period))
+#define hal_compare_stop()      bclr(OCIE1A,TIMSK1)
+
+// Timer1 UI tick: compare B interrupt every period us
+#define hal_tick_start(period)  do { OCR1B = TCNT1 + (period); TIFR1 = _BV(OCF1B); bset(OCIE1B,TIMSK1); } while (0)
+#define hal_tick_period(period) (OCR1B += (period))
+#define hal_tick_stop()         bclr(OCIE1B,TIMSK1)
+#define hal_tick_running()      btst(OCIE1B,TIMSK1)
+
+// free running 1us timebase for the profiler
+#define hal_ticks()             TCNT1
+#define hal_timer1()            TCNT1 // Timer1 now, a capture value without ICP1
+
+// receiver output PB0, low = Mark
+#define hal_rx_mark()           (!btst(0,PINB))
+
+// power-down wakeup: pin change on PB0, INT1 low level. back to falling edge, that may set the INT1 flag
+#ifdef PROVISION
+#define WAKE_PCIE (_BV(PCIE0) | _BV(PCIE2)) // the receiver, and RXD for the table protocol
+#else
+#define WAKE_PCIE _BV(PCIE0)
+#endif
+#define hal_wake_arm()          do { PCIFR = WAKE_PCIE; PCICR |= WAKE_PCIE; EICRA = 0x00; } while (0) // PCIFn = PCIEn
+#define hal_wake_disarm()       do { PCICR &= ~WAKE_PCIE; EICRA = 0x08; EIFR = _BV(INTF1); } while (0)
+#define hal_sleep(deep)         do { set_sleep_mode((deep) ? SLEEP_MODE_PWR_DOWN : SLEEP_MODE_IDLE); sei(); sleep_cpu(); } while (0) // no interrupt between sei and sleep
+
+// Timer2 receive timeout
+#define hal_timeout_restart()   (TCNT2 = 135) // 135=15ms until overflow
+#define hal_timeout_guard()     (TCNT2 = 225) // 225=4ms until overflow, the silence that ends a burst of noise
+#define hal_timeout_start()     do { bset(TOV2,TIFR2); bset(TOIE2,TIMSK2); } while (0)
+#define hal_timeout_stop()      bclr(TOIE2,TIMSK2)
+
+// EEPROM
+#define hal_ee_read(addr)       eeprom_read_byte((const uint8_t*)(uintptr_t)(addr))
+#define hal_ee_write(addr,val)  eeprom_update_byte((uint8_t*)(uintptr_t)(addr),(val)) // writes only if different
+
+// code table: a byte of flash, also in interrupt
+#define hal_flash_byte(addr)    pgm_read_byte((uint16_t)(addr))
+
+// UART
+#define hal_uart_txready()      btst(UDRE0,UCSR0A)
+#define hal_uart_tx(c)          (UDR0 = (c))
+#define hal_uart_rxready()      btst(RXC0,UCSR0A)
+#define hal_uart_rx()           UDR0
+#define hal_uart_txint_on()     bset(UDRIE0,UCSR0B) // data register empty interrupt
+#define hal_uart_txint_off()    bclr(UDRIE0,UCSR0B)
+#define hal_uart_txc_on()       do { UCSR0A = _BV(TXC0) | _BV(U2X0); bset(TXCIE0,UCSR0B); } while (0) // tx complete interrupt, after the last Byte
+#define hal_uart_txc_off()      bclr(TXCIE0,UCSR0B)
+#define hal_uart_busy()         (UCSR0B & (_BV(UDRIE0) | _BV(TXCIE0))) // not in power-down, it stops the uart
+
+#else // HOSTED
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef SPM_PAGESIZE // the Makefile sets the flash of MCU_TARGET, these are the atmega328p
+#define SPM_PAGESIZE 128
+#endif
+#ifndef EESIZE
+#define EESIZE 1024
+#endif
+#define ISR(vect) void vect(void) // the simulator calls the interrupt routines as plain functions
+#define PROGMEM // constant strings and tables stay in RAM
+#define PSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+
+// simulated peripheral state, see host/hal_host.c
+struct hal
+{
+    uint8_t sreg_i;      // global interrupt enable, cli()/sei()
+    uint8_t led;         // status LED level
+    uint8_t ir;          // 1 = Mark (38khz on), 0 = Space
+    uint8_t capture;     // 1 = Timer1 capture interrupt enabled
+    uint8_t compare;     // 1 = Timer1 compare A interrupt enabled
+    uint8_t capedge;     // capture edge: 0 = falling, 1 = rising
+    uint8_t rxmark;      // receiver input level, 1 = Mark
+    uint8_t wake;        // 1 = power-down, wakeup by pin change / INT1 armed
+    uint16_t tcnt1;      // Timer1 counter, the simulator sets it to its time before calling an isr
+    uint16_t icr;        // Timer1 capture value handed to TIMER1_CAPT_vect
+    uint16_t ocr;        // Timer1 compare value
+    uint32_t t1starts;   // counts hal_compare_start(), the simulator restarts its Timer1 period on change
+    uint8_t tick;        // 1 = Timer1 compare B (UI tick) interrupt enabled
+    uint16_t ocrb;       // Timer1 compare B value
+    uint8_t button;      // learn button, 1 = pressed
+    uint8_t buttonint;   // 1 = INT1 enabled
+    uint8_t timeout;     // 1 = Timer2 overflow interrupt enabled
+    uint8_t tcnt2;       // Timer2 counter preset by the capture isr
+    void (*uart_tx)(uint8_t c); // receives every byte sent on the uart, may be 0
+    int uart_rx;         // next received byte or -1
+    uint8_t udrie;       // 1 = uart data register empty interrupt enabled
+    uint32_t flash_reads;  // statistics of the flash emulator
+    uint32_t flash_writes;
+    uint32_t flash_erases;
+    uint32_t ee_reads;   // statistics of the eeprom emulator
+    uint32_t ee_writes;
+    uint32_t powercut;   // power is lost after this many more flash or eeprom writes, 0 = never
+    uint8_t off;         // power lost: flash and eeprom writes are dropped until hal_poweron()
+};
+
+extern struct hal Hal;
+
+#define cli()                   (Hal.sreg_i = 0)
+#define sei()                   (Hal.sreg_i = 1)
+
+void hal_init(void); // resets the peripheral state and fills the flash table with 0xff
+void hal_poweron(void); // resets the peripheral state, the flash and eeprom keep their content and the statistics go on
+
+#define hal_led_on()            (Hal.led = 1)
+#define hal_led_off()           (Hal.led = 0)
+#define hal_led_toggle()        (Hal.led ^= 1)
+
+#define hal_button()            (Hal.button)
+#define hal_button_start()      (Hal.buttonint = 1)
+#define hal_button_stop()       (Hal.buttonint = 0)
+
+#define hal_ir_mark()           (Hal.ir = 1)
+#define hal_ir_space()          (Hal.ir = 0)
+
+#define hal_capture_start()     (Hal.capture = 1, Hal.capedge = 0)
+#define hal_capture_stop()      (Hal.capture = 0)
+#define hal_capture_running()   (Hal.capture)
+#define hal_capture_value()     (Hal.icr)
+#define hal_capture_toggle_edge() (Hal.capedge ^= 1)
+
+#define hal_compare_start(period) (Hal.ocr = Hal.tcnt1 + (period), Hal.compare = 1, Hal.t1starts++)
+#define hal_compare_period(period) (Hal.ocr += (period))
+#define hal_compare_stop()      (Hal.compare = 0)
+
+#define hal_tick_start(period)  (Hal.ocrb = Hal.tcnt1 + (period), Hal.tick = 1)
+#define hal_tick_period(period) (Hal.ocrb += (period))
+#define hal_tick_stop()         (Hal.tick = 0)
+#define hal_tick_running()      (Hal.tick)
+
+WORD hal_ticks(void); // host clock in us
+#define hal_timer1()            (Hal.tcnt1)
+
+#define hal_rx_mark()           (Hal.rxmark)
+
+#define hal_wake_arm()          (Hal.wake = 1)
+#define hal_wake_disarm()       (Hal.wake = 0)
+
+#define hal_timeout_restart()   (Hal.tcnt2 = 135)
+#define hal_timeout_guard()     (Hal.tcnt2 = 225)
+#define hal_timeout_start()     (Hal.timeout = 1)
+#define hal_timeout_stop()      (Hal.timeout = 0)
+
+#define hal_uart_txready()      1
+#define hal_uart_tx(c)          do { if (Hal.uart_tx) Hal.uart_tx(c); } while (0)
+#define hal_uart_rxready()      (Hal.uart_rx >= 0)
+#define hal_uart_rx()           hal_uart_getbyte()
+uint8_t hal_uart_getbyte(void);
+#define hal_uart_txint_on()     (Hal.udrie = 1)
+#define hal_uart_txint_off()    (Hal.udrie = 0)
+#define hal_uart_txc_on()       // the simulator sends a Byte in one go
+#define hal_uart_txc_off()
+#define hal_uart_busy()         (Hal.udrie)
+
+uint8_t *hal_flash_page(uint32_t page); // direct access to an emulated table page, 0 if out of range
+uint8_t hal_flash_byte(uint16_t addr); // a byte of the table at flash address addr
+
+uint8_t hal_ee_read(uint16_t addr);
+void hal_ee_write(uint16_t addr, uint8_t val);
+
+#endif // HOSTED
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ AVR IR Blaster. Hardware abstraction layer, AVR part.
+ Peripheral setup after reset and the flash page routines.
+ All other HAL calls are macros in hal.h.
+
+ Copyright Thomas Krueger, Hofgeismar, Germany
+ December 2019
+ */
+
+#include "IRblaster.h"
+
+/* the code table pages at the end of the flash, placed by the linker (--section-start=codetable in the Makefile).
+It fails the build if the code or its data reach them. Not in the hex file (objcopy -j .text -j .data -j bootspm),
+so flashing the firmware does not write the table, see host/irtcomp for a table with the firmware.
+*/
+const BYTE Codetable[TABPAGES*SPM_PAGESIZE] __attribute__((section("codetable"), used));
+extern const BYTE __start_codetable[], __stop_codetable[]; // by the linker
+extern const BYTE __data_load_end[]; // end of the code and its data in flash, by the linker script
+BYTE Minpage;
+BYTE Maxpage;
+
+/* On parts with a boot section (atmega168, atmega328p) SPM works only from there: the page write and erase are
+placed at its start (--section-start=bootspm in the Makefile). BOOTSTART is the smallest boot section, fuses BOOTSZ=11:
+256 words at 0x7E00 on the atmega328p, 128 words at 0x3F00 on the atmega168 (make fuses).
+They read nothing from the application section, it is not readable while a page of it is written.
+*/
+#ifdef BOOTSTART
+#define BOOTSPM __attribute__((section("bootspm"), noinline))
+#else
+#define BOOTSPM
+#endif
+
+
+void hal_init(void)
+{
+    Minpage = (WORD)__start_codetable / SPM_PAGESIZE;
+    Maxpage = (WORD)__stop_codetable / SPM_PAGESIZE - 1;
+    // the code reaches the table (a layout of the Makefile too small for it): no page is in range,
+    // so learn and erase never write over the firmware
+    if ((WORD)__data_load_end > (WORD)__start_codetable) Maxpage = 0;
+
+    // After Reset, all port-pins are input/tri-state. Output Data is all 0. watchdog is disabled.
+    // To enable pullup of an input, write 1 to port-data register-bit.
+    // Port Registers B,C,D:PORTB=Data; DDRB=direction(1=output); PINB=Bittoggle on write 1.
+
+    // set 8MHz with internal RC oscillator. Note: default after Reset normally is 1Mhz!
+    CLKPR = _BV(CLKPCE); // enable clock prescale change
+    CLKPR = 0; // set 8 MHz
+
+    // status LED output on PD2
+    bset(2,DDRD);
+
+    // IR LED output on PD6
+    bset(6,DDRD);
+
+    // IR Receiver digital input on PB0
+    bclr(0,DDRB);
+    bset(0,PORTD); // enable pullup
+
+    // Learn-Button input on PD3 INT1
+    bclr(3,DDRD);
+    bset(3,PORTD); // enable pullup
+
+    // init serial:
+    UBRR0H = 0;
+    UBRR0L = 103; // 12=9600 Baud at 1mhz; 103=9600 Baud at 8mhz
+    UCSR0A = 0x02; //double speed
+    UCSR0B = 0x18; // RxTx enable
+    UCSR0C = 0x06; // 8N1
+#if defined(PROFILE) || defined(PROVISION)
+    bset(RXCIE0,UCSR0B); // receive interrupt for the profiler commands and the table protocol
+#endif
+
+
+    // TIMER 0: (8Bit)
+    /* Timer0 is the 38kHz oscillator on output OC0A Pin PD6, the transmit output to IR LED.
+    timer0 runs in CTC mode (Clear Timer on Compare) and toggle OC0A Pin.
+    Thus the value of the compare register determines the frequency of the symetric squarewave output.
+    Note: the CTC togglepin function introduces another divide by 2. So the formular for the comparevalue is:
+    Fcpu/(divider*frequency*2) or (8Mhz/(1*38000*2)
+    The oscillator is outputed on Pin PD6 only, if COM0A0 in TCCR0A is set to 1, else it is isolated from PD6
+    and the general portpin output data is active (see below, its 0).
+    So: COM0A0 1 = Mark(38khz), COM0A0 = 0, Space (0)
+    */
+    TCCR0A = 0x02; // CTC-mode
+    TCCR0B = 0x01; // clocksource = systemclock
+    OCR0A = 106;  // set output compare register to desired frequency!!! 8Mhz/(1*2*38000)=105.
+
+    bset(6,DDRD); // set portpin pd6 to output. Thats the OC0A frequency 38KHZ. control with COM0A0 in TCCR0A
+    bclr(6,PORTD); // clear output for Spacelevel 0 = LED off.
+
+    // TIMER1: (16Bit) free running for capture (receiver) and compare A (transmitter), see set_receiver() / set_transmitter()
+    TCCR1A = 0; // normal 16bit mode up counter.
+    TCCR1B = 0x82; // noice-canceller, falling-edge, clocksource = systemclock/8
+
+    //Timer2(8Bit) Timeout generator for receive.
+    TCCR2A = 0; // normal up counter
+    TCCR2B = 0x07; // input clock is 8Mhz/1024. 128ns/tick. 7812 Hz. times out after 32ms at count 255.
+
+    // learncode-button input INT1 enable
+    EICRA=0x08; // falling edge
+    bset(INT1,EIMSK);
+
+    // receiver pin change wakes from power-down, enabled by hal_wake_arm()
+    bset(PCINT0,PCMSK0);
+#ifdef PROVISION
+    bset(PCINT16,PCMSK2); // RXD, a request of the table protocol
+#endif
+
+    // power down not needed peripherals. UART only on debugprint, profiler or table protocol
+    ADCSRA = 0; // ADC off before its clock is stopped
+    bset(ACD,ACSR); // analog comparator off
+#if defined(DBPRINT) || defined(PROFILE) || defined(PROVISION)
+    PRR = _BV(PRTWI) | _BV(PRSPI) | _BV(PRADC);
+#else
+    PRR = _BV(PRTWI) | _BV(PRSPI) | _BV(PRUSART0) | _BV(PRADC);
+#endif
+}
+
+
+/* write SPM_PAGESIZE Bytes to flash (one page!):
+
+NOTE: The SELFPRGEN Fuse Bit must be programmed, otherwise you cannot write to flash !!!!
+	  BLB0,1,2 Fuses may need to be set to "SPM no restriction" on some AVR processors.
+
+The addressable flash region is the section of Codetable, after the code. See TABPAGES in the Makefile.
+entry:
+- page = pagenumber from MINPAGE to MAXPAGE(inclusive)
+- *buf = pointer to sourcebuffer(RAM) containing the SPM_PAGESIZE-Bytes to write.
+
+The addressed page is erased, then SPM_PAGESIZE Bytes are written to the flash.
+
+For Atmega328p: flashsize=16384-words or 32768-Bytes. SPM_PAGESIZE is 64Words or 128Bytes, Number of pages=256 or 0 - 255
+It has a Boot-section, check BLB0,1,2 Fuses. SPM runs from the boot section, see BOOTSPM.
+*/
+void flash_write_page (uint32_t page, uint8_t *buf)
+{
+    flash_erase_page (page);
+    flash_program_page (page, buf);
+}
+
+/* write SPM_PAGESIZE Bytes to flash without erasing the page first:
+Programming only clears bits, so this is for erased slots of a page and for the tombstones of the log
+(see the table format in IRblaster.c). Bytes already written must be passed unchanged.
+*/
+BOOTSPM void flash_program_page (uint32_t page, uint8_t *buf)
+{
+    uint16_t i;
+    uint8_t sreg;
+
+    if ((page > MAXPAGE) || (page < MINPAGE)) return; // page number out of range
+    page *= SPM_PAGESIZE; // convert pagenumber to actual start-address of the page in flash !!!!
+
+    sreg = SREG; // save status register for later restore (simulate an interrupt)
+    cli(); // Disable interrupts.
+    eeprom_busy_wait (); // wait possible eeprom action, this will corrupt flashing.
+
+    for (i=0; i<SPM_PAGESIZE; i+=2) // write your data to the special register-buffer,Z-pointer(this is NOT normal RAM!)
+    {
+        // the registerbuffer is WORD addressed and takes WORDs, so even amounts only.
+        uint16_t w = *buf++;
+        w += (*buf++) << 8; // little endian
+
+        boot_page_fill (page + i, w); // write to register buffer one word
+    }
+
+    boot_page_write (page);     // flash the page from the registerbuffer.(internal algorithm)
+    boot_spm_busy_wait();       // Wait until flashing is finished.
+
+#ifdef BOOTSTART
+    boot_rww_enable (); // Reenable RWW-section. only when RWW-section is present!!
+#endif
+
+    SREG = sreg; // restore the status register with possible int-enable flags
+}
+
+/* read SPM_PAGESIZE Bytes from flash(one page!):
+entry:
+- page = pagenumber from MINPAGE to MAXPAGE(inclusive)
+- *buf = pointer to destinationbuffer(RAM) receiving the SPM_PAGESIZE-Bytes.
+
+No Bootsection restrictions!
+
+*/
+void flash_read_page (uint32_t page, uint8_t *buf)
+{
+
+    uint8_t sreg;
+
+    if ((page > MAXPAGE) || (page < MINPAGE)) return; // page number out of range
+    page *= SPM_PAGESIZE;
+
+    sreg = SREG; // save status register for later restore
+    cli(); // Disable interrupts.
+
+    //void * memcpy_P( void *dest, const void *src, size_t n )
+    //The memcpy_P() function returns a pointer to dest or 0 on error
+    memcpy_P(buf, (const void*)(uintptr_t)(page), SPM_PAGESIZE); // copy data from flash to buffer using the clib function in pgmspace.h
+
+    SREG = sreg; // restore the status register with possible int-enable flags
+}
+
+/* erase one page of the code table (all bytes 0xff):
+entry:
+- page = pagenumber from MINPAGE to MAXPAGE(inclusive)
+*/
+BOOTSPM void flash_erase_page (uint32_t page)
+{
+    uint8_t sreg;
+
+    if ((page > MAXPAGE) || (page < MINPAGE)) return; // page number out of range
+    page *= SPM_PAGESIZE;
+
+    sreg = SREG; // save status register for later restore
+    cli(); // Disable interrupts.
+    eeprom_busy_wait (); // wait possible eeprom action, this will corrupt flashing.
+
+    boot_page_erase (page); // erase the destination page
+    boot_spm_busy_wait ();      // Wait until page is erased.
+#ifdef BOOTSTART
+    boot_rww_enable ();
+#endif
+
+    SREG = sreg; // restore the status register with possible int-enable flags
+}
@@ -0,0 +1,129 @@
+/*
+ AVR IR Blaster. Hardware abstraction layer, hosted (Linux) part.
+ Simulated peripheral state and a RAM-backed flash emulator for the code table pages MINPAGE..MAXPAGE.
+ The timer/gpio calls of hal.h are macros on the "Hal" struct, the simulator reads and writes it directly.
+
+ Copyright Thomas Krueger, Hofgeismar, Germany
+ December 2019
+ */
+
+#include "IRblaster.h"
+#include <time.h>
+
+
+struct hal Hal;
+
+static uint8_t Flash[(MAXPAGE-MINPAGE+1)*SPM_PAGESIZE]; // the code table, erased flash is 0xff
+static uint8_t Eeprom[EESIZE];
+
+
+void hal_init(void)
+{
+    memset(&Hal,0,sizeof(Hal));
+    hal_poweron();
+    memset(Flash,0xff,sizeof(Flash));
+    memset(Eeprom,0xff,sizeof(Eeprom));
+}
+
+void hal_poweron(void)
+{
+    struct hal h = Hal;
+
+    memset(&Hal,0,sizeof(Hal));
+    Hal.uart_rx = -1;
+    Hal.buttonint = 1; // INT1 enabled by hal_init()
+    Hal.uart_tx = h.uart_tx;
+    Hal.flash_reads = h.flash_reads;
+    Hal.flash_writes = h.flash_writes;
+    Hal.flash_erases = h.flash_erases;
+    Hal.ee_reads = h.ee_reads;
+    Hal.ee_writes = h.ee_writes;
+}
+
+WORD hal_ticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000u + ts.tv_nsec/1000;
+}
+
+uint8_t hal_uart_getbyte(void)
+{
+    uint8_t c = Hal.uart_rx;
+    Hal.uart_rx = -1;
+    return c;
+}
+
+// a write to flash or eeprom is done, the power cut of Hal.powercut may stop it
+static int powered(void)
+{
+    if (Hal.off) return 0;
+    if (Hal.powercut && !--Hal.powercut) Hal.off = 1; // this is the last write
+    return 1;
+}
+
+uint8_t *hal_flash_page(uint32_t page)
+{
+    if ((page > MAXPAGE) || (page < MINPAGE)) return 0; // page number out of range
+    return &Flash[(page-MINPAGE)*SPM_PAGESIZE];
+}
+
+uint8_t hal_flash_byte(uint16_t addr)
+{
+    uint8_t *p = hal_flash_page(addr / SPM_PAGESIZE);
+
+    return p ? p[addr % SPM_PAGESIZE] : 0xff;
+}
+
+void flash_read_page (uint32_t page, uint8_t *buf)
+{
+    uint8_t *p = hal_flash_page(page);
+
+    if (!p) return;
+    memcpy(buf,p,SPM_PAGESIZE);
+    Hal.flash_reads++;
+}
+
+void flash_write_page (uint32_t page, uint8_t *buf)
+{
+    uint8_t *p = hal_flash_page(page);
+
+    if (!p || !powered()) return;
+    memcpy(p,buf,SPM_PAGESIZE); // erase + write of a whole page
+    Hal.flash_erases++;
+    Hal.flash_writes++;
+}
+
+void flash_program_page (uint32_t page, uint8_t *buf)
+{
+    uint8_t *p = hal_flash_page(page);
+    uint8_t i;
+
+    if (!p || !powered()) return;
+    for (i=0; i<SPM_PAGESIZE; i++) p[i] &= buf[i]; // write without erase only clears bits
+    Hal.flash_writes++;
+}
+
+void flash_erase_page (uint32_t page)
+{
+    uint8_t *p = hal_flash_page(page);
+
+    if (!p || !powered()) return;
+    memset(p,0xff,SPM_PAGESIZE);
+    Hal.flash_erases++;
+}
+
+uint8_t hal_ee_read(uint16_t addr)
+{
+    Hal.ee_reads++;
+    return addr < EESIZE ? Eeprom[addr] : 0xff;
+}
+
+void hal_ee_write(uint16_t addr, uint8_t val)
+{
+    if (addr >= EESIZE || Eeprom[addr] == val) return; // eeprom_update_byte() writes only if different
+    if (!powered()) return;
+    Eeprom[addr] = val;
+    Hal.ee_writes++;
+}
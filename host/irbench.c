@@ -0,0 +1,307 @@
+/*
+ AVR IR Blaster. irbench: decoder accuracy and throughput benchmark.
+
+ Generates synthetic pulse-distance/pulse-width frames, feeds their edges into TIMER1_CAPT_vect
+ (so the durations are quantized exactly like on the target, diff/40, and decoded by rxstep() into the
+ receive slot) and finishes the decode with decodeframe() like the main loop.
+ Reports per protocol:
+ - ok      decodeframe() accepted the frame with the sent code and bitcount
+ - wrong   accepted with another code or bitcount, the rest was rejected
+ - BER     bit errors of the accepted frames
+ - tshort/tlong  mean and max error of the recovered timshort/timlong, in 40us units
+ - cost of decodeframe() per frame, the decode left after the end of the frame (ns, and cpu cycles on x86)
+
+ A protocol without a stop pulse (sirc) ends with the Mark of its last Bit, its Space is the idle line. The decoder
+ takes that Mark as the stoplen, so the expected code has one Bit less, and the frame is sent back the same.
+ The sirc 1-Bit Mark is twice its Space, the decoder needs more than twice: it relies on the longer Marks of the
+ receiver (-k), without skew and jitter no sirc frame decodes.
+ Codes of more than 32 Bits are not supported by the decoder (panasonic), they are listed as such.
+
+ usage: irbench [-n frames] [-j jitter] [-k skew] [-g glitches] [-s seed] [-p protocol] [-o dumpfile] [corpusfile...]
+   -n  frames per protocol (default 200000)
+   -j  uniform timing jitter +-us on every duration (default 60)
+   -k  duty cycle skew in us, Marks get longer, Spaces shorter (default 40)
+   -g  glitches per 1000 frames, a 40..120us pulse split into a random duration (default 5)
+   -p  only run this protocol: nec samsung sirc jvc panasonic
+   -o  write every generated frame in the corpus format, to build a corpus
+ corpusfile: "Capcnt:... Code:..." frames, host/irtrace -c writes them from the trace of a DBPRINT build.
+   Every frame is decoded again with decodebuf() and compared with the dumped result, a difference is counted
+   as wrong (not as bit error).
+*/
+
+#include "IRblaster.h"
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0
+#endif
+
+void TIMER1_CAPT_vect(void);
+
+struct proto
+{
+    const char *name;
+    WORD sync1, sync2;  // us
+    WORD mark0, space0; // 0-Bit
+    WORD mark1, space1; // 1-Bit
+    BYTE bits;
+    WORD stop;          // stop Mark or 0
+};
+
+static const struct proto Protos[] =
+{
+    { "nec",       9000, 4500, 560, 560,  560, 1690, 32, 560 },
+    { "samsung",   4500, 4500, 560, 560,  560, 1690, 32, 560 },
+    { "sirc",      2400,  600, 600, 600, 1200,  600, 12,   0 },
+    { "jvc",       8400, 4200, 526, 526,  526, 1574, 16, 526 },
+    { "panasonic", 3456, 1728, 432, 432,  432, 1296, 48, 432 },
+};
+#define NPROTOS (sizeof(Protos)/sizeof(Protos[0]))
+
+struct result
+{
+    uint32_t frames, ok, wrong, biterrs, bits;
+    double serr, lerr, smax, lmax;
+    uint64_t ns, cycles;
+};
+
+static uint32_t Seed = 1;
+static FILE *Dump;
+static BYTE Raw[IOSIZE]; // durations of the frame like the capture isr quantizes them, for the dump and the corpus
+
+
+static uint32_t rnd(void) // xorshift32
+{
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 17;
+    Seed ^= Seed << 5;
+    return Seed;
+}
+
+static uint64_t nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+// receive a frame of durations (Mark first) through the capture isr, like TIMER2_OVF_vect ends it
+static void capture(const int *d, int n)
+{
+    uint32_t t = rnd(); // random Timer1 phase, tests the 16bit wraparound
+    int i;
+
+    set_receiver();
+    Hal.icr = t;
+    TIMER1_CAPT_vect();
+    for (i=0; i<n; i++)
+    {
+        if (i+1 < IOSIZE) Raw[i+1] = (WORD)((WORD)(t + d[i]) - (WORD)t) / 40;
+        t += d[i];
+        Hal.icr = t;
+        TIMER1_CAPT_vect();
+    }
+    if ((Capcnt < 20) || Rx->err || Noise) Errors++;
+}
+
+// decode what is in the receive slot, returns 0 if accepted
+static BYTE decode(struct result *r)
+{
+    uint64_t t0, c0;
+    BYTE ret;
+
+    t0 = nsec();
+    c0 = CYCLES();
+    ret = decodeframe(Rx);
+    r->cycles += CYCLES() - c0;
+    r->ns += nsec() - t0;
+    return ret || Errors;
+}
+
+static void dump(void)
+{
+    BYTE i;
+
+    if (!Dump) return;
+    fprintf(Dump,"\n\nCapcnt:%u Code:0x%08lx s1:%u s2:%u ",Capcnt,(unsigned long)CS.sendcode,CS.sync1,CS.sync2);
+    fprintf(Dump,"stoplen:%u timshort:%u timlong:%u cod:%u bits:%u\n",CS.stoplen,CS.timshort,CS.timlong,CS.coding,CS.bits);
+    for (i=0; i<Capcnt && i<IOSIZE; i++) fprintf(Dump," %u",i ? Raw[i] : 0);
+}
+
+static int jitter(int d, int j)
+{
+    if (j) d += (int)(rnd() % (2*j+1)) - j;
+    return d > 1 ? d : 1;
+}
+
+static void bench(const struct proto *p, struct result *r, uint32_t n, int jit, int skew, int glitch)
+{
+    int d[2*64+8];
+    double es = (p->mark0 + p->space0) / 80.0; // expected timshort, 40us units
+    double el = (p->mark1 + p->space1) / 40.0 - es; // expected timlong
+
+    memset(r,0,sizeof(*r));
+    while (n--)
+    {
+        uint64_t code = ((uint64_t)rnd() << 32) | rnd();
+        int i, k=0;
+
+        d[k++] = p->sync1;
+        d[k++] = p->sync2;
+        for (i=0; i<p->bits; i++)
+        {
+            d[k++] = (code>>i)&1 ? p->mark1 : p->mark0;
+            d[k++] = (code>>i)&1 ? p->space1 : p->space0;
+        }
+        if (p->stop) d[k++] = p->stop;
+        else k--; // the last Space is the idle line
+
+        for (i=0; i<k; i++) d[i] = jitter(d[i] + (i&1 ? -skew : skew), jit);
+
+        if (glitch && (int)(rnd()%1000) < glitch) // split a duration by a short pulse
+        {
+            int g = 40 + rnd()%81;
+            int at = rnd()%k;
+            if (d[at] > g+2)
+            {
+                int a = 1 + rnd()%(d[at]-g-1);
+                memmove(&d[at+2],&d[at],(k-at)*sizeof(int));
+                d[at+2] -= a+g;
+                d[at] = a;
+                d[at+1] = g;
+                k += 2;
+            }
+        }
+
+        capture(d,k);
+        r->frames++;
+        if (decode(r)) continue;
+        dump();
+
+        BYTE nb = p->stop ? p->bits : p->bits-1; // without stop pulse the last Mark is the stoplen
+        ULONG want = (ULONG)code & (nb<32 ? (1UL<<nb)-1 : 0xffffffffUL);
+        ULONG diff = CS.comparecode ^ want;
+        if (!diff && CS.bits == nb && CS.stoplen) r->ok++;
+        else r->wrong++;
+        for (; diff; diff&=diff-1) r->biterrs++;
+        r->bits += nb;
+
+        double se = CS.timshort - es, le = CS.timlong - el;
+        if (se<0) se=-se;
+        if (le<0) le=-le;
+        r->serr += se; r->lerr += le;
+        if (se > r->smax) r->smax = se;
+        if (le > r->lmax) r->lmax = le;
+    }
+}
+
+static void report(const char *name, const struct result *r)
+{
+    uint32_t n = r->ok+r->wrong ? r->ok+r->wrong : 1;
+    uint32_t f = r->frames ? r->frames : 1;
+
+    printf("%-10s %8u %6.2f%% %6.2f%% %9.2e %5.2f/%-5.2f %5.2f/%-5.2f %7.1f %8.0f\n", name, r->frames,
+           100.0*r->ok/f, 100.0*r->wrong/f, r->bits ? (double)r->biterrs/r->bits : 0.0,
+           r->serr/n, r->smax, r->lerr/n, r->lmax, (double)r->ns/f, (double)r->cycles/f);
+}
+
+// replay a corpus and compare the decoding with the dumped result
+static int corpus(const char *fn, struct result *r)
+{
+    FILE *f = fopen(fn,"r");
+    unsigned cap, s1, s2, stop, ts, tl, cod, bits, v;
+    unsigned long code;
+
+    if (!f)
+    {
+        perror(fn);
+        return 1;
+    }
+    memset(r,0,sizeof(*r));
+    while (fscanf(f," Capcnt:%u Code:%lx s1:%u s2:%u stoplen:%u timshort:%u timlong:%u cod:%u bits:%u",
+                  &cap,&code,&s1,&s2,&stop,&ts,&tl,&cod,&bits) == 9)
+    {
+        BYTE i;
+
+        Capcnt = cap;
+        Errors = 0;
+        for (i=0; i<cap && fscanf(f,"%u",&v)==1; i++)
+            if (i<IOSIZE) Raw[i]=v;
+        if (cap < IOSIZE) Raw[cap]=0;
+
+        r->frames++;
+        uint64_t t0 = nsec(), c0 = CYCLES();
+        BYTE ret = decodebuf(Raw);
+        r->cycles += CYCLES() - c0;
+        r->ns += nsec() - t0;
+        if (ret) continue;
+        if (CS.sendcode==code && CS.bits==bits && CS.sync1==s1 && CS.sync2==s2 && CS.stoplen==stop &&
+            CS.timshort==ts && CS.timlong==tl && CS.coding==cod) r->ok++;
+        else
+            r->wrong++;
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n = 200000;
+    int jit = 60, skew = 40, glitch = 5, c;
+    const char *only = 0;
+    struct result r;
+    unsigned i;
+
+    while ((c = getopt(argc,argv,"n:j:k:g:s:p:o:")) != -1)
+    {
+        switch (c)
+        {
+            case 'n': n = atoi(optarg); break;
+            case 'j': jit = atoi(optarg); break;
+            case 'k': skew = atoi(optarg); break;
+            case 'g': glitch = atoi(optarg); break;
+            case 's': Seed = strtoul(optarg,0,0); if (!Seed) Seed=1; break;
+            case 'p': only = optarg; break;
+            case 'o':
+                Dump = fopen(optarg,"w");
+                if (!Dump)
+                {
+                    perror(optarg);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr,"usage: irbench [-n frames] [-j jitter] [-k skew] [-g glitches] [-s seed] [-p protocol] [-o dumpfile] [corpusfile...]\n");
+                return 2;
+        }
+    }
+
+    hal_init();
+    printf("jitter +-%dus, skew %dus, %d glitches per 1000 frames\n",jit,skew,glitch);
+    printf("%-10s %8s %7s %7s %9s %11s %11s %7s %8s\n","protocol","frames","ok","wrong","BER",
+           "tshort avg/max","tlong avg/max","ns/fr","cyc/fr");
+
+    for (i=0; i<NPROTOS; i++)
+    {
+        if (only && strcmp(only,Protos[i].name)) continue;
+        if (Protos[i].bits > 32)
+        {
+            printf("%-10s %u Bits, not supported (32 Bits max)\n",Protos[i].name,Protos[i].bits);
+            continue;
+        }
+        bench(&Protos[i],&r,n,jit,skew,glitch);
+        report(Protos[i].name,&r);
+    }
+
+    for (; optind<argc; optind++)
+    {
+        if (corpus(argv[optind],&r)) return 2;
+        printf("%s: %u frames, %u decoded identical to the dump, %u different\n",argv[optind],r.frames,r.ok,r.wrong);
+    }
+
+    if (Dump) fclose(Dump);
+    return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ AVR IR Blaster. irsim: replay an IR edge trace through the firmware ISRs and report
+ the end-to-end translation latency.
+
+ usage: irsim [-w] [-e us] [-u us] [-t file] [-l file] [-d file] tracefile       (- = stdin)
+   -w  print the transmitted waveform as Mark/Space durations in us
+   -e  feed the transmitted waveform back to the receiver after us, like the IR LEDs next to the receiver
+   -u  start-up time from power-down in us, for other clock fuses (default SIM_WAKEUP, see sim.h)
+   -t  write the serial output to file, with DBPRINT (make host HOSTDEFS=-DDBPRINT) the binary trace for host/irtrace
+   -l  start with the code table image in file (host/irtcomp -b, irtable dump), then power on
+   -d  write the code table at the end to file, an image of the pages MINPAGE..MAXPAGE for host/irtable
+
+ The current is an estimate: the time in IDLE and in power-down times the currents of main() (I_IDLE, I_DOWN).
+
+ Trace file, one item per line, # starts a comment:
+   1234          absolute time of an edge in us, edges alternate Mark start / Mark end
+   +560          edge 560us after the previous one
+   code <comparecode> <sendcode> <sync1> <sync2> <stoplen> <timshort> <timlong> <coding> <bits> [next]
+                 append a record to the code table, same fields and units as struct ircode.
+                 Chains: first record next=0xAA, followon records comparecode 0.
+                 coding: + 2*(sends-1) + pause before each send in ms (multiple of 8, 0 = 65ms), see TC_GAP
+   button <us>   press the learn button at the time of the last edge for us, then it is released for us
+ Table commands:
+   find <comparecode>    look the code up, prints its slot and the records of its chain
+   delete <comparecode>  delete the code with its chain like menu 9
+   erase         erase the table like menu 4, the pages are erased by the table job (JOB_ERASE)
+   compact       start a compaction step, the table job JOB_COMPACT (COMPACT)
+   job <n>       run n steps of the table job like the idle main loop, 0 = until it is done
+   cut <n>       the power is lost after n more flash or eeprom writes, the firmware runs on without them
+   poweron       power on again with the flash and eeprom as they are, prints the log found
+ code and the table commands but cut and poweron run after the frame being received and its translation,
+ like the learn menu in the main loop. The next edge counts from then.
+*/
+
+#include "sim.h"
+
+#define I_IDLE 8.5 // mA at 8Mhz measured on the board, see main()
+#define I_DOWN 1.8 // mA, mostly the IR receiver
+
+static BYTE Wave;
+static FILE *Serial;
+static const char *Image;
+static const char *Load;
+static uint32_t Cnt, Min1=~0u, Max1, Sum1, Min2=~0u, Max2, Sum2;
+
+
+static void done(const struct simtx *t)
+{
+    uint32_t lat = t->firstmark - t->lastedge;
+    uint32_t tot = t->end - t->start;
+    int i;
+
+    printf("tx %u: code 0x%08lx records %u edge->mark %u us (eot %u + gap %u) frame->end %u us\n",
+           Cnt+1, (unsigned long)t->code, t->records, lat, t->eot - t->lastedge, t->firstmark - t->eot, tot);
+    if (Wave)
+    {
+        for (i=1; i<t->nedges; i++) printf(" %u",t->edge[i]-t->edge[i-1]);
+        printf("\n");
+    }
+
+    Cnt++;
+    Sum1 += lat; if (lat<Min1) Min1=lat; if (lat>Max1) Max1=lat;
+    Sum2 += tot; if (tot<Min2) Min2=tot; if (tot>Max2) Max2=tot;
+}
+
+// the main loop changes the table after the frame being received and its translation, like the learn menu.
+// returns the time then
+static uint32_t settle(uint32_t t)
+{
+    sim_run(t);
+    while (Capcnt || Rxframes || Txbusy) sim_run(Sim.now + 1000);
+    return Sim.now;
+}
+
+static void serial(uint8_t c)
+{
+    putc(c,Serial);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f;
+    char line[256];
+    uint32_t t=0;
+    int ln=0;
+    uint32_t echo=0;
+    long wakeup=-1;
+
+    while (argc>1 && argv[1][0]=='-' && argv[1][1])
+    {
+        if (!strcmp(argv[1],"-w")) Wave=1;
+        else if (!strcmp(argv[1],"-e") && argc>2)
+        {
+            echo = strtoul(argv[2],0,10);
+            argc--; argv++;
+        }
+        else if (!strcmp(argv[1],"-u") && argc>2)
+        {
+            wakeup = strtoul(argv[2],0,10);
+            argc--; argv++;
+        }
+        else if (!strcmp(argv[1],"-l") && argc>2)
+        {
+            Load = argv[2];
+            argc--; argv++;
+        }
+        else if (!strcmp(argv[1],"-d") && argc>2)
+        {
+            Image = argv[2];
+            argc--; argv++;
+        }
+        else if (!strcmp(argv[1],"-t") && argc>2)
+        {
+            if (!(Serial = fopen(argv[2],"wb")))
+            {
+                perror(argv[2]);
+                return 2;
+            }
+            argc--; argv++;
+        }
+        else break;
+        argc--; argv++;
+    }
+    if (argc!=2)
+    {
+        fprintf(stderr,"usage: irsim [-w] [-e us] [-u us] [-t file] [-l file] [-d file] tracefile\n");
+        return 2;
+    }
+    f = strcmp(argv[1],"-") ? fopen(argv[1],"r") : stdin;
+    if (!f)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    sim_reset();
+    if (Load)
+    {
+        static BYTE img[(MAXPAGE-MINPAGE+1)*SPM_PAGESIZE];
+        FILE *l = fopen(Load,"rb");
+
+        if (!l || fread(img,1,sizeof(img),l) != sizeof(img))
+        {
+            fprintf(stderr,"%s: not a table image of %u Bytes\n",Load,(unsigned)sizeof(img));
+            return 2;
+        }
+        fclose(l);
+        sim_table_load(img);
+    }
+    Sim.done = done;
+    Sim.echo = echo;
+    if (wakeup >= 0) Sim.wakeup = wakeup;
+    if (Serial) Hal.uart_tx = serial;
+
+    while (fgets(line,sizeof(line),f))
+    {
+        char *p = line + strspn(line," \t");
+        ln++;
+        if (*p=='#' || *p=='\n' || !*p) continue;
+
+        if (!strncmp(p,"code",4))
+        {
+            struct ircode r;
+            unsigned long cc,sc;
+            unsigned v[8] = {0};
+
+            if (sscanf(p+4,"%lx %lx %u %u %u %u %u %u %u %x",&cc,&sc,&v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6],&v[7]) < 9)
+            {
+                fprintf(stderr,"%s:%d: bad code record\n",argv[1],ln);
+                return 2;
+            }
+            r.comparecode=cc; r.sendcode=sc;
+            r.sync1=v[0]; r.sync2=v[1]; r.stoplen=v[2]; r.timshort=v[3];
+            r.timlong=v[4]; r.coding=v[5]; r.bits=v[6]; r.next=v[7];
+            t = settle(t);
+            if (sim_table_add(&r)) fprintf(stderr,"%s:%d: code table full\n",argv[1],ln);
+            continue;
+        }
+
+        if (!strncmp(p,"button",6))
+        {
+            sim_button(t,1);
+            t += strtoul(p+6,0,10);
+            sim_button(t,0);
+            t += strtoul(p+6,0,10);
+            continue;
+        }
+
+        if (!strncmp(p,"find",4))
+        {
+            uint32_t ee = Hal.ee_reads;
+            SLOT n,s;
+
+            t = settle(t);
+            CS.comparecode = strtoul(p+4,0,16);
+            if (findcode())
+            {
+                printf("find 0x%08lx: not found, eeprom reads %u\n",(unsigned long)CS.comparecode,Hal.ee_reads-ee);
+                continue;
+            }
+            for (n=1, s=Rec; (slotrec(s)->timing & REC_NEXT) && (n < RECORDS); n++) s = nextslot(s);
+            printf("find 0x%08lx: slot %u records %u\n",(unsigned long)CS.comparecode,Rec,n);
+            continue;
+        }
+
+        if (!strncmp(p,"delete",6))
+        {
+            t = settle(t);
+            CS.comparecode = strtoul(p+6,0,16);
+            if (!findcode()) killrec(Rec);
+            continue;
+        }
+
+        if (!strncmp(p,"erase",5))
+        {
+            t = settle(t);
+            while (jobstep()); // like learncode()
+            starterase();
+            continue;
+        }
+
+        if (!strncmp(p,"compact",7))
+        {
+            t = settle(t);
+#ifdef COMPACT
+            if (!Job) Job = JOB_COMPACT;
+#else
+            fprintf(stderr,"%s:%d: no compaction without COMPACT\n",argv[1],ln);
+#endif
+            continue;
+        }
+
+        if (!strncmp(p,"job",3))
+        {
+            uint32_t n = strtoul(p+3,0,10), i;
+
+            t = settle(t);
+            for (i=0; Job && (!n || (i < n)); i++) jobstep();
+            printf("job: %u steps, %s\n",i,Job ? "running" : "done");
+            continue;
+        }
+
+        if (!strncmp(p,"cut",3))
+        {
+            Hal.powercut = strtoul(p+3,0,10);
+            continue;
+        }
+
+        if (!strncmp(p,"poweron",7))
+        {
+            BYTE lost = Hal.off;
+
+            sim_run(t);
+            sim_poweron();
+            printf("power on%s: head %u tail page %u live records %u%s\n",lost ? " after a power loss" : "",
+                   Head,Tail,Live,Job ? ", table job running" : "");
+            continue;
+        }
+
+        if (*p=='+') t += strtoul(p+1,0,10);
+        else t = strtoul(p,0,10);
+        sim_edge(t);
+    }
+    sim_idle();
+
+    printf("frames %u translated %u edges lost %u\n",Sim.frames,Sim.translated,Sim.lost);
+    if (Rejects[NZ_SYNC] || Rejects[NZ_SHORT] || Rejects[NZ_LONG])
+        printf("noise bursts rejected: sync %u short %u long %u\n",Rejects[NZ_SYNC],Rejects[NZ_SHORT],Rejects[NZ_LONG]);
+    if (Hal.wake) Sim.down += Sim.now - Sim.downstart;
+    printf("power-down %.1f%% of %u ms, %u wakeups, estimated average %.2f mA (IDLE %.1f mA, power-down %.1f mA)\n",
+           Sim.now ? 100.0*Sim.down/Sim.now : 0.0, Sim.now/1000, Sim.wakes,
+           Sim.now ? (I_IDLE*(Sim.now-Sim.down) + I_DOWN*Sim.down)/Sim.now : I_DOWN, I_IDLE, I_DOWN);
+    printf("table records %u, learn menu %s\n",Live,Learnbut ? "open" : "closed");
+    printf("flash page reads %u writes %u erases %u, eeprom reads %u writes %u\n",Hal.flash_reads,Hal.flash_writes,Hal.flash_erases,Hal.ee_reads,Hal.ee_writes);
+    if (Cnt)
+    {
+        printf("edge->mark  min %u avg %u max %u us\n",Min1,Sum1/Cnt,Max1);
+        printf("frame->end  min %u avg %u max %u us\n",Min2,Sum2/Cnt,Max2);
+    }
+    if (Serial) fclose(Serial);
+    if (Image)
+    {
+        FILE *d = fopen(Image,"wb");
+        BYTE p;
+
+        for (p=MINPAGE; d && p<=MAXPAGE; p++) fwrite(hal_flash_page(p),SPM_PAGESIZE,1,d);
+        if (!d || fclose(d)) perror(Image);
+    }
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ AVR IR Blaster. irstress: random store/delete/compact/power loss test of the code table.
+
+ A fixed-seed random sequence of table operations runs on the firmware code in the flash and eeprom emulator,
+ after every operation each code of a model must be found with its chain (or not at all if it was deleted):
+ - learn: a chain of 1..3 codes like learncode(), the last one a waveform record with random data slots sometimes.
+   A code learned again is an update. A chain the table has no room for is not learned, the model keeps the old one.
+ - delete a code (menu 9)
+ - compaction steps (JOB_COMPACT) and the background erase (menu 4), seldom
+ - power on again: findlog() and checkdir() with the flash and eeprom as they are
+ - power loss: a random write of the operation is the last one (Hal.powercut), then power on. The table must hold
+   the codes as before or after the operation, a chain completely or not at all, and no older copy comes back.
+ The codes are NEC codes of a few remotes and random 32 Bit codes, so the table and the directory fill up.
+
+ usage: irstress [-n operations] [-s seed] [-c codes] [-v]
+   -n  operations (default 20000)
+   -s  random seed (default 1)
+   -c  distinct codes used (default 3/2 of the directory entries)
+   -v  print every operation
+ exit 1 on the first mismatch
+*/
+
+#include "sim.h"
+#include <unistd.h>
+
+#define MAXCODES 2048
+
+struct model // what the table should hold for a code
+{
+    ULONG code;
+    BYTE n;         // records of the chain, 0 = not in the table
+    ULONG send[3];
+    BYTE timing[3]; // index into Tim
+    BYTE raw;       // the last record is a waveform
+    BYTE slots;     // its data slots
+    BYTE data[RAWSLOTS*RAWPERSLOT];
+};
+
+static struct model Model[MAXCODES], Before;
+static int Ncodes, Verbose;
+static unsigned long Seed;
+static struct irtiming Tim[] = { // the timings of a few remotes
+    {225,112,14,14,42,0,32}, // NEC
+    {210,105,13,13,39,0,16}, // JVC
+    {60,15,15,15,30,0x80,12}, // SIRC style, a gap
+};
+
+static unsigned rnd(unsigned n)
+{
+    Seed = Seed * 1103515245 + 12345;
+    return (Seed >> 16) % n;
+}
+
+// power on again with the flash and eeprom as they are
+static void poweron(void)
+{
+    sim_poweron();
+    while (jobstep()); // an erase cut by the power loss
+}
+
+// 1 if the table holds code m as the model says
+static int holds(const struct model *m)
+{
+    struct irrec *p;
+    SLOT s;
+    BYTE i;
+
+    CS.comparecode = m->code;
+    if (findcode()) return !m->n;
+    if (!m->n) return 0;
+    s = Rec;
+    for (i=0; i<m->n; i++, s=nextslot(s))
+    {
+        p = slotrec(s);
+        if ((p->comparecode != (i ? 0 : m->code)) || (p->sendcode != m->send[i])) return 0;
+        if ((i+1 == m->n) && m->raw)
+        {
+            if ((p->timing & (REC_RAW|REC_NEXT)) != (REC_RAW|REC_NEXT) || (rawslots(p->sendcode) != m->slots)) return 0;
+            break;
+        }
+        if ((i+1 < m->n) != !!(p->timing & REC_NEXT)) return 0;
+        if (p->timing & REC_RAW) return 0;
+        if (memcmp(&Timings[p->timing & REC_TIMING],&Tim[m->timing[i]],sizeof(struct irtiming))) return 0;
+    }
+    for (i=0; m->raw && (i<m->slots); i++)
+    {
+        s = nextslot(s);
+        p = slotrec(s);
+        if (p->comparecode || memcmp(&p->sendcode,m->data + i*RAWPERSLOT,RAWPERSLOT)) return 0;
+        if ((p->timing & ~REC_NEXT) != REC_DATA || (i+1 < m->slots) != !!(p->timing & REC_NEXT)) return 0;
+    }
+    return 1;
+}
+
+// check every code, m may be in the state before or after the operation. returns the number of mismatches
+static int check(struct model *m)
+{
+    int i, bad = 0;
+    SLOT live = Live;
+
+    for (i=0; i<Ncodes; i++)
+    {
+        if (holds(&Model[i])) continue;
+        if ((&Model[i] == m) && holds(&Before)) // the operation was cut before its commit
+        {
+            *m = Before;
+            continue;
+        }
+        fprintf(stderr,"code 0x%08lx: %s\n",(unsigned long)Model[i].code,Model[i].n ? "wrong or not found" : "found, deleted");
+        bad++;
+    }
+    if (live > used())
+    {
+        fprintf(stderr,"%u live records in %u slots\n",live,used());
+        bad++;
+    }
+    return bad;
+}
+
+// learn a new chain for m like learncode(). returns 0=OK, 1=no room
+static BYTE learn(struct model *m)
+{
+    struct irrec r[3];
+    struct ircode c;
+    BYTE i, t, n = 1 + rnd(3), raw = 0, tim[3];
+    BYTE data[RAWSLOTS*RAWPERSLOT];
+    struct rawhead h;
+
+    memset(&c,0,sizeof(c));
+    for (i=0; i<n; i++)
+    {
+        r[i].comparecode = i ? 0 : m->code;
+        r[i].sendcode = rnd(0x10000) << 16 | rnd(0x10000);
+        if ((i+1 == n) && !rnd(4)) // a waveform
+        {
+            h.durs = RAWMIN + rnd(RAWMAX-RAWMIN);
+            h.nsym = 2;
+            h.bits = 1;
+            h.slots = 1 + rnd(RAWSLOTS);
+            memcpy(&r[i].sendcode,&h,sizeof(h));
+            for (t=0; t<h.slots*RAWPERSLOT; t++) data[t] = rnd(256);
+            r[i].timing = REC_RAW | REC_NEXT; // the data slots follow
+            raw = 1;
+        }
+        else
+        {
+            tim[i] = rnd(sizeof(Tim)/sizeof(Tim[0]));
+            memcpy(&c.sync1,&Tim[tim[i]],sizeof(struct irtiming));
+            t = findtiming(&c);
+            if (t >= TIMINGS) return 1;
+            r[i].timing = t;
+        }
+        if (i+1 < n) r[i].timing |= REC_NEXT; // a waveform is the last one
+    }
+    if (makeroom(n + (raw ? h.slots + RAWRESERVE - reserve() : 0))) goto full;
+    CS.comparecode = m->code;
+    if (findcode() == 2) goto full;
+    if (storechain(r,n,raw ? data : 0)) goto full;
+
+    m->n = n;
+    for (i=0; i<n; i++)
+    {
+        m->send[i] = r[i].sendcode;
+        m->timing[i] = tim[i];
+    }
+    m->raw = raw;
+    if (raw)
+    {
+        m->slots = h.slots;
+        memcpy(m->data,data,h.slots*RAWPERSLOT);
+    }
+    return 0;
+
+full:
+    loadtimings(); // drop the timings of the chain
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long ops = 20000, i, learned = 0, full = 0, deleted = 0, compactions = 0, erases = 0, boots = 0, cuts = 0;
+    unsigned long misses = 0, missreads = 0, seed;
+    BYTE probe = 0;
+    int j, c;
+    BYTE a, k;
+    struct model *m;
+    ULONG code;
+
+    Seed = 1;
+    Ncodes = DIRSIZE*3/2;
+    while ((c = getopt(argc,argv,"n:s:c:v")) != -1)
+        switch (c)
+        {
+            case 'n': ops = strtoul(optarg,0,0); break;
+            case 's': Seed = strtoul(optarg,0,0); break;
+            case 'c': Ncodes = atoi(optarg); break;
+            case 'v': Verbose = 1; break;
+            default:
+            fprintf(stderr,"usage: irstress [-n operations] [-s seed] [-c codes] [-v]\n");
+            return 2;
+        }
+    if (Ncodes < 1 || Ncodes > MAXCODES) Ncodes = MAXCODES;
+    seed = Seed;
+
+    for (j=0; j<Ncodes; j++) // distinct codes, most of them NEC codes of 4 remotes
+    {
+        do
+        {
+            if (rnd(4))
+            {
+                a = 0x10 + rnd(4); // address, command and both inverted
+                k = rnd(256);
+                code = a | (ULONG)(~a & 0xff) << 8 | (ULONG)k << 16 | (ULONG)(~k & 0xff) << 24;
+            }
+            else code = rnd(0x10000) << 16 | rnd(0x10000);
+            for (c=0; (c<j) && (Model[c].code != code); c++);
+        } while (!code || (code == 0xffffffffUL) || (c < j));
+        Model[j].code = code;
+    }
+
+    sim_reset();
+    for (i=0; i<ops; i++)
+    {
+        m = &Model[rnd(Ncodes)];
+        Before = *m;
+        c = rnd(1000);
+        if (!rnd(8)) // power loss during the operation
+        {
+            Hal.powercut = 1 + rnd(40);
+            cuts++;
+        }
+        if (c < 600)
+        {
+            if (learn(m)) full++;
+            else learned++;
+            if (Verbose) printf("%lu: learn 0x%08lx, %u records%s\n",i,(unsigned long)m->code,m->n,m->raw ? " waveform" : "");
+        }
+        else if (c < 850)
+        {
+            CS.comparecode = m->code;
+            if (!findcode()) killrec(Rec);
+            m->n = 0;
+            deleted++;
+            if (Verbose) printf("%lu: delete 0x%08lx\n",i,(unsigned long)m->code);
+        }
+        else if (c < 950)
+        {
+#ifdef COMPACT
+            Job = JOB_COMPACT;
+            while (jobstep()) compactions++;
+            if (Verbose) printf("%lu: compact\n",i);
+#endif
+        }
+        else if (c < 999)
+        {
+            if (Verbose) printf("%lu: power on\n",i);
+        }
+        else
+        {
+            starterase();
+            while (jobstep());
+            for (j=0; j<Ncodes; j++) Model[j].n = 0;
+            Before.n = 0;
+            erases++;
+            if (Verbose) printf("%lu: erase\n",i);
+        }
+        j = Hal.off;
+        if (j || Hal.powercut || (c >= 950 && c < 999))
+        {
+            if (j && Verbose) printf("%lu: power lost\n",i);
+            poweron();
+            boots++;
+        }
+        if (hal_ee_read(EE_PROBE) > probe) probe = hal_ee_read(EE_PROBE);
+        if (check(j ? m : 0))
+        {
+            fprintf(stderr,"irstress: mismatch after operation %lu, seed %lu\n",i,seed);
+            return 1;
+        }
+
+        CS.comparecode = rnd(0x10000) << 16 | rnd(0x10000); // a code not in the table, mostly
+        c = Hal.ee_reads;
+        if (findcode())
+        {
+            misses++;
+            missreads += Hal.ee_reads - c;
+        }
+    }
+    for (j=0, c=0; j<Ncodes; j++) c += Model[j].n != 0;
+    printf("%lu operations: %lu learned, %lu no room, %lu deleted, %lu compactions, %lu erases, %lu power on, %lu power cuts\n",
+        ops,learned,full,deleted,compactions,erases,boots,cuts);
+    printf("%d codes in %u of %u slots at the end, %u directory entries, furthest probe %u\n",c,used(),(unsigned)RECORDS,(unsigned)DIRSIZE,probe);
+    if (misses) printf("a miss reads %.1f eeprom Bytes\n",(double)missreads/misses);
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ AVR IR Blaster. irtable: backup and restore of the code table over serial (firmware built with PROVISION).
+
+ usage: irtable [-p port | -e | -s] command...
+   -p  serial port of the blaster, 9600 8N1 (default /dev/ttyUSB0)
+   -e  talk to an emulated blaster in this process: the hosted firmware with its flash emulator, empty table
+   -s  serve an emulated blaster on a pty and print its name, for irtable -p <name> (a loopback test without hardware)
+ commands, executed in order:
+   info          print the table layout of the blaster and its counters of rejected noise bursts
+   dump file     write the table pages MINPAGE..MAXPAGE to file, a binary image
+   upload file   write the image page by page, read every page back, then the blaster translates with it
+   verify file   compare the table of the blaster with the image
+
+ The protocol is described at PV_SYNC in IRblaster.h. A request without a valid reply is repeated,
+ after zero Bytes that complete a request the blaster may have started to receive.
+*/
+
+#define _GNU_SOURCE // posix_openpt(), cfmakeraw()
+#include "sim.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+
+#define TRIES 5
+#define WAIT 500 // ms for a reply, a page takes 75ms on the line
+
+static int Fd = -1;     // serial port, -1 = emulated blaster
+static BYTE Emq[256];   // emulated blaster: its reply
+static int Emn, Emget;
+static BYTE Minpage, Maxpage, Pagesize;
+static WORD Rej[NZ_N]; // noise counters of the blaster, 0 from an older firmware
+
+
+static void emulated(uint8_t c)
+{
+    if (Emn < (int)sizeof(Emq)) Emq[Emn++] = c;
+}
+
+static void sendbytes(const BYTE *b, int n)
+{
+    if (Fd < 0)
+    {
+        while (n--) sim_uart(Sim.now + SIM_UARTBYTE, *b++);
+        return;
+    }
+    if (write(Fd,b,n) != n) perror("write");
+}
+
+// a Byte of the reply, -1 after WAIT ms
+static int getbyte(void)
+{
+    struct pollfd p = { Fd, POLLIN, 0 };
+    BYTE c;
+
+    if (Fd < 0) return Emget < Emn ? Emq[Emget++] : -1;
+    if (poll(&p,1,WAIT) <= 0 || read(Fd,&c,1) != 1) return -1;
+    return c;
+}
+
+/* send a request and wait for its reply, data: SPM_PAGESIZE Bytes for PV_WRITE, the reply data for the others.
+returns the status of the reply, -1 if there was none
+*/
+static int request(BYTE cmd, BYTE page, BYTE *data)
+{
+    BYTE req[3+256+2], zero[256+5] = {0};
+    int n = 0, i, c, tries, len;
+    WORD crc;
+
+    req[n++] = PV_SYNC;
+    req[n++] = cmd;
+    req[n++] = page;
+    if (cmd == PV_WRITE) for (i=0; i<Pagesize; i++) req[n++] = data[i];
+    for (crc=0, i=1; i<n; i++) crc = crc16(crc,req[i]);
+    req[n++] = crc >> 8;
+    req[n++] = crc;
+
+    for (tries=0; tries<TRIES; tries++)
+    {
+        if (tries) // complete a request the blaster may have started, then drop its replies
+        {
+            sendbytes(zero,Pagesize+5);
+            while (getbyte() >= 0);
+        }
+        Emn = Emget = 0;
+        sendbytes(req,n);
+
+        while ((c = getbyte()) >= 0 && c != PV_SYNC); // skip the trace of a DBPRINT build
+        if (c < 0) continue;
+        BYTE h[3];
+        for (crc=0, i=0; i<3 && (c = getbyte()) >= 0; i++) crc = crc16(crc,h[i] = c);
+        if (c < 0 || h[0] != cmd) continue;
+        len = h[2];
+        BYTE buf[256];
+        for (i=0; i<len+2 && (c = getbyte()) >= 0; i++) crc = crc16(crc,buf[i] = c);
+        if (c < 0 || crc) continue; // damaged
+        if (h[1] == PV_ECRC || h[1] == PV_EBUSY) continue;
+        if (data && cmd != PV_WRITE) memcpy(data,buf,len);
+        return h[1];
+    }
+    return -1;
+}
+
+static int check(int st, const char *what)
+{
+    static const char *err[] = { "ok", "damaged", "page out of range", "unknown command", "busy", "not begun" };
+
+    if (st == PV_OK) return 0;
+    fprintf(stderr,"%s: %s\n",what,st < 0 ? "no reply" : st < 6 ? err[st] : "error");
+    return 1;
+}
+
+static int info(void)
+{
+    BYTE b[256] = {0};
+    int i;
+
+    if (check(request(PV_INFO,0,b),"info")) return 1;
+    Minpage = b[0];
+    Maxpage = b[1];
+    Pagesize = b[2];
+    for (i=0; i<NZ_N; i++) Rej[i] = b[3+2*i] | b[4+2*i] << 8;
+    return 0;
+}
+
+// the image in file, exactly the table size
+static BYTE *readimage(const char *fn, long size)
+{
+    FILE *f = fopen(fn,"rb");
+    BYTE *img = malloc(size+1);
+
+    if (!f)
+    {
+        perror(fn);
+        return 0;
+    }
+    if (fread(img,1,size+1,f) != (size_t)size)
+    {
+        fprintf(stderr,"%s: not a table image of %ld Bytes\n",fn,size);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    return img;
+}
+
+static int dump(const char *fn)
+{
+    int p, pages = Maxpage-Minpage+1;
+    BYTE *img = malloc(pages*Pagesize);
+    FILE *f;
+
+    for (p=0; p<pages; p++)
+        if (check(request(PV_READ,Minpage+p,img+p*Pagesize),"read")) return 1;
+    if (!(f = fopen(fn,"wb")) || fwrite(img,Pagesize,pages,f) != (size_t)pages)
+    {
+        perror(fn);
+        return 1;
+    }
+    fclose(f);
+    printf("dump %s: pages %u..%u, %d Bytes\n",fn,Minpage,Maxpage,pages*Pagesize);
+    return 0;
+}
+
+static int verify(const char *fn, BYTE *img)
+{
+    int p, bad = 0, pages = Maxpage-Minpage+1;
+    BYTE page[256];
+
+    if (!img && !(img = readimage(fn,(long)pages*Pagesize))) return 1;
+    for (p=0; p<pages; p++)
+    {
+        if (check(request(PV_READ,Minpage+p,page),"read")) return 1;
+        if (memcmp(page,img+p*Pagesize,Pagesize))
+        {
+            fprintf(stderr,"verify: page %u differs\n",Minpage+p);
+            bad++;
+        }
+    }
+    printf("verify %s: %s\n",fn,bad ? "FAILED" : "ok");
+    return bad != 0;
+}
+
+static int upload(const char *fn)
+{
+    int p, pages = Maxpage-Minpage+1;
+    BYTE *img = readimage(fn,(long)pages*Pagesize);
+
+    if (!img) return 1;
+    if (check(request(PV_BEGIN,0,0),"begin")) return 1;
+    for (p=0; p<pages; p++)
+        if (check(request(PV_WRITE,Minpage+p,img+p*Pagesize),"write")) return 1;
+    if (verify(fn,img)) return 1; // the blaster translates with the old RAM state until the commit
+    if (check(request(PV_COMMIT,0,0),"commit")) return 1;
+    printf("upload %s: %d pages\n",fn,pages);
+    return 0;
+}
+
+static void rawtty(int fd)
+{
+    struct termios t;
+
+    if (tcgetattr(fd,&t)) return;
+    cfmakeraw(&t);
+    cfsetispeed(&t,B9600);
+    cfsetospeed(&t,B9600);
+    tcsetattr(fd,TCSANOW,&t);
+}
+
+static void serve_tx(uint8_t c)
+{
+    if (write(Fd,&c,1) != 1) perror("pty");
+}
+
+// the emulated blaster on a pty, until killed
+static int serve(void)
+{
+    int slave;
+    BYTE c;
+
+    if ((Fd = posix_openpt(O_RDWR|O_NOCTTY)) < 0 || grantpt(Fd) || unlockpt(Fd) || (slave = open(ptsname(Fd),O_RDWR|O_NOCTTY)) < 0)
+    {
+        perror("pty");
+        return 1;
+    }
+    rawtty(slave); // kept open, no hangup when a client closes
+    printf("%s\n",ptsname(Fd));
+    fflush(stdout);
+    Hal.uart_tx = serve_tx;
+    while (read(Fd,&c,1) == 1) sim_uart(Sim.now + SIM_UARTBYTE, c);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *port = "/dev/ttyUSB0";
+    int emulate = 0, i;
+
+    while (argc>1 && argv[1][0]=='-')
+    {
+        if (!strcmp(argv[1],"-p") && argc>2)
+        {
+            port = argv[2];
+            argc--; argv++;
+        }
+        else if (!strcmp(argv[1],"-e")) emulate = 1;
+        else if (!strcmp(argv[1],"-s")) emulate = 2;
+        else break;
+        argc--; argv++;
+    }
+    if ((argc<2 && emulate != 2) || (argc>1 && argv[1][0]=='-'))
+    {
+        fprintf(stderr,"usage: irtable [-p port | -e | -s] info | dump file | upload file | verify file ...\n");
+        return 2;
+    }
+
+    if (emulate)
+    {
+        sim_reset();
+        Hal.uart_tx = emulated;
+        if (emulate == 2) return serve();
+    }
+    else
+    {
+        if ((Fd = open(port,O_RDWR|O_NOCTTY)) < 0)
+        {
+            perror(port);
+            return 2;
+        }
+        rawtty(Fd);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC,&t0);
+    if (info()) return 1;
+    for (i=1; i<argc; i++)
+    {
+        int err = 0;
+
+        if (!strcmp(argv[i],"info"))
+        {
+            printf("table pages %u..%u of %u Bytes\n",Minpage,Maxpage,Pagesize);
+            printf("noise bursts rejected: sync %u short %u long %u\n",Rej[NZ_SYNC],Rej[NZ_SHORT],Rej[NZ_LONG]);
+        }
+        else if (i+1 < argc && !strcmp(argv[i],"dump")) err = dump(argv[++i]);
+        else if (i+1 < argc && !strcmp(argv[i],"upload")) err = upload(argv[++i]);
+        else if (i+1 < argc && !strcmp(argv[i],"verify")) err = verify(argv[++i],0);
+        else
+        {
+            fprintf(stderr,"unknown command %s\n",argv[i]);
+            err = 1;
+        }
+        if (err) return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&t1);
+    if (Fd >= 0) printf("%.1f s\n",(t1.tv_sec-t0.tv_sec) + (t1.tv_nsec-t0.tv_nsec)/1e9);
+    return 0;
+}
@@ -0,0 +1,446 @@
+/*
+ AVR IR Blaster. irtcomp: compile a mapping file into the code table offline, for many units with the same mappings.
+
+ usage: irtcomp [-o file] [-f firmware.hex] [-b file] [-E file] mapfile       (- = stdin)
+   -o  the table pages MINPAGE..MAXPAGE as Intel HEX at MINPAGE*SPM_PAGESIZE (default stdout)
+   -f  merge: the records of firmware.hex first, then the table, one file for avrdude (make flash TABLE=mapfile)
+   -b  the same pages as binary image, for host/irtable upload and irsim -l
+   -E  the eeprom as Intel HEX: hashed directory and receive profiles, so the first power on takes them as is
+
+ Mapping file, one item per line, # starts a comment:
+   timing <name> <sync1> <sync2> <stoplen> <timshort> <timlong> <coding> <bits>
+                 a timing profile, same fields and units as struct irtiming (coding with TC_REPEAT and TC_GAP)
+   <source> <dest> [<dest> [<dest>]] [hits <n>]
+                 translate source into the codes dest, sent one after the other (a chain, like learn menu 2 and 3)
+                 hits: expected presses of the key, default 1
+   A code is <timing>:<hexcode>, or the durations of a captured frame in 40us units, Mark first, in brackets
+   as host/irtrace logs them: (225 112 14 14 ...). A captured dest that does not decode is stored as waveform,
+   only as the last dest. A source may be a bare hexcode, with a timing or captured it adds the receive profile
+   of its remote (see endprofile).
+
+ The table is built by the firmware itself (storechain, addprofile) in the flash emulator, so the layout is the one
+ learning writes. Offline the mappings are known in advance: a source given again replaces the mapping before,
+ and the records are written in the order of their hits. Then the image is loaded like at power on and every source
+ is looked up, irtcomp reports the flash pages and directory entries findcode() reads per key press, weighted by hits.
+*/
+
+#include "sim.h"
+#include <ctype.h>
+
+#define NAMES 32 // timing profiles in the mapping file, the table takes TIMINGS of them
+#define CHAIN 3  // codes per mapping, see learncode()
+#define IMAGE ((MAXPAGE-MINPAGE+1)*SPM_PAGESIZE)
+#define EEBYTES EESIZE // the directory takes the rest of the eeprom
+
+struct map
+{
+    struct irrec r[CHAIN];
+    BYTE n;
+    BYTE raw[RAWSLOTS*RAWPERSLOT]; // the waveform data of the last code, if it is REC_RAW
+    struct irtiming src; // receive profile of the source, bits 0 = none
+    unsigned long hits;
+    int line;
+};
+
+static struct map Map[RECORDS];
+static int Nmap;
+static char Name[NAMES][16];
+static struct irtiming Named[NAMES];
+static int Nnames;
+static const char *Fn;
+static int Ln;
+static ULONG Hexbase; // upper 16 Bits of the address in the HEX file
+
+
+static int error(const char *msg)
+{
+    fprintf(stderr,"%s:%d: %s\n",Fn,Ln,msg);
+    return 1;
+}
+
+/* parse the code at *pp into c, a timing of the file or the decode of a captured frame.
+A captured frame that does not decode: bits BITS_RAW and its packed waveform in raw, if raw is given.
+returns 0=OK, 1=error (printed)
+*/
+static int code(char **pp, struct ircode *c, BYTE *raw)
+{
+    char *p = *pp, *e;
+    BYTE buf[IOSIZE+1];
+    int i, n;
+
+    memset(c,0,sizeof(*c));
+    if (*p == '(')
+    {
+        for (n=1, p++; *p && *p != ')'; n++)
+        {
+            unsigned long d = strtoul(p,&e,10);
+            if (e == p || !d || d > 255 || n >= IOSIZE) return error("bad captured frame");
+            buf[n] = d;
+            for (p=e; isspace((BYTE)*p); p++);
+        }
+        if (*p++ != ')') return error("missing )");
+        *pp = p;
+        buf[0] = buf[n] = 0;
+        if ((n >= 20) && !decodebuf(buf)) // as doframe(), at least 20 edges
+        {
+            *c = CS;
+            return 0;
+        }
+        if (!raw) return error("the captured frame does not decode");
+#ifndef WAVEFORM
+        return error("the captured frame does not decode, waveform records need WAVEFORM");
+#else
+        Rawn = 0; // its waveform, as the capture isr records it in learnmode
+        memset(Rawbuf,0,RAWSYM+RAWMAX/2);
+        for (i=1; i<n; i++) rawstep(buf[i]);
+        if (Rawn < RAWMIN || Rawn > RAWMAX) return error("the captured frame does not decode and is no waveform");
+        c->sendcode = rawpack();
+        c->bits = BITS_RAW;
+        memcpy(raw,Rawbuf,rawslots(c->sendcode)*RAWPERSLOT);
+        return 0;
+#endif
+    }
+
+    for (e=p; *e && *e != ':' && !isspace((BYTE)*e); e++);
+    if (*e == ':')
+    {
+        for (i=0; i<Nnames; i++)
+            if ((int)strlen(Name[i]) == e-p && !strncmp(Name[i],p,e-p)) break;
+        if (i >= Nnames) return error("unknown timing");
+        memcpy(&c->sync1,&Named[i],sizeof(struct irtiming));
+        p = e+1;
+    }
+    else if (raw) return error("a dest needs a timing");
+    c->comparecode = c->sendcode = strtoul(p,&e,16);
+    if (e == p || (*e && !isspace((BYTE)*e))) return error("bad code");
+    *pp = e;
+    return 0;
+}
+
+static int mapping(char *p)
+{
+    struct map m;
+    struct ircode c;
+    int i;
+
+    memset(&m,0,sizeof(m));
+    m.hits = 1;
+    m.line = Ln;
+    if (code(&p,&c,0)) return 1;
+    if (!c.comparecode) return error("source code 0 is never received");
+    if (c.bits) memcpy(&m.src,&c.sync1,sizeof(struct irtiming));
+    m.r[0].comparecode = c.comparecode;
+
+    for (;;)
+    {
+        ULONG src = m.r[0].comparecode;
+
+        while (isspace((BYTE)*p)) p++;
+        if (!*p || *p == '#') break;
+        if (!strncmp(p,"hits",4) && isspace((BYTE)p[4]))
+        {
+            m.hits = strtoul(p+4,&p,10);
+            continue;
+        }
+        if (m.n >= CHAIN) return error("more than 3 dests");
+        if (m.n && (m.r[m.n-1].timing & REC_RAW)) return error("a waveform only as the last dest");
+        if (code(&p,&c,m.raw)) return 1;
+        if (c.bits == BITS_RAW) m.r[m.n].timing = REC_RAW | REC_NEXT; // the data slots follow
+        else
+        {
+            if (c.sendcode == src) return error("translates to itself");
+            m.r[m.n].timing = findtiming(&c);
+            if (m.r[m.n].timing >= TIMINGS) return error("more timings than the dictionary holds");
+        }
+        m.r[m.n].sendcode = c.sendcode;
+        if (m.n) m.r[m.n-1].timing |= REC_NEXT;
+        m.n++;
+    }
+    if (!m.n) return error("no dest");
+
+    for (i=0; i<Nmap; i++)
+        if (Map[i].r[0].comparecode == m.r[0].comparecode) break;
+    if (i < Nmap) // a source given again replaces the mapping
+    {
+        if (memcmp(Map[i].r,m.r,sizeof(m.r))) fprintf(stderr,"%s:%d: source 0x%08lx replaces line %d\n",Fn,Ln,
+                                                        (unsigned long)m.r[0].comparecode,Map[i].line);
+        else m.hits += Map[i].hits; // the same mapping twice
+        memmove(&Map[i],&Map[i+1],(Nmap-i-1)*sizeof(m));
+        Nmap--;
+    }
+    if (Nmap >= RECORDS) return error("more mappings than the table holds");
+    Map[Nmap++] = m;
+    return 0;
+}
+
+static int readmap(FILE *f)
+{
+    char line[1024], *p;
+    int err = 0;
+
+    memset(Timings,0xff,sizeof(Timings)); // the dictionary of the table, filled by findtiming()
+    while (fgets(line,sizeof(line),f))
+    {
+        Ln++;
+        p = line + strspn(line," \t");
+        if (*p=='#' || *p=='\n' || !*p) continue;
+        if (!strncmp(p,"timing",6) && isspace((BYTE)p[6]))
+        {
+            unsigned v[7];
+            char name[16];
+
+            if (Nnames >= NAMES) err |= error("too many timings");
+            else if (sscanf(p+6,"%15s %u %u %u %u %u %u %u",name,&v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6]) != 8)
+                err |= error("bad timing");
+            else
+            {
+                struct irtiming *t = &Named[Nnames];
+
+                strcpy(Name[Nnames++],name);
+                t->sync1=v[0]; t->sync2=v[1]; t->stoplen=v[2]; t->timshort=v[3];
+                t->timlong=v[4]; t->coding=v[5]; t->bits=v[6];
+            }
+            continue;
+        }
+        err |= mapping(p);
+    }
+    return err;
+}
+
+// fewest hits first, they are written first and searched last. the file order otherwise
+static int byhits(const void *a, const void *b)
+{
+    const struct map *x = a, *y = b;
+
+    if (x->hits != y->hits) return x->hits < y->hits ? -1 : 1;
+    return x->line - y->line;
+}
+
+// write the mappings into the emulated table and eeprom, like learncode() does
+static int build(void)
+{
+    int i;
+#ifdef RXPROF
+    int profs = 0;
+    BYTE next;
+#endif
+
+    qsort(Map,Nmap,sizeof(struct map),byhits);
+    for (i=0; i<Nmap; i++)
+    {
+        struct map *m = &Map[i];
+
+#ifdef RXPROF
+        if (m->src.bits)
+        {
+            memcpy(&CS.sync1,&m->src,sizeof(struct irtiming));
+            next = Profnext;
+            addprofile();
+            if (next != Profnext && ++profs == NPROF+1) fprintf(stderr,"more than %u receive profiles, the last ones are kept\n",NPROF);
+        }
+#endif
+        CS.comparecode = m->r[0].comparecode;
+        if (findcode() == 2 || storechain(m->r,m->n,(m->r[m->n-1].timing & REC_RAW) ? m->raw : 0))
+        {
+            fprintf(stderr,"%s:%d: the table is full\n",Fn,m->line);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void hexrec(FILE *f, BYTE type, WORD addr, const BYTE *d, BYTE n)
+{
+    BYTE sum = n + (addr>>8) + addr + type;
+
+    fprintf(f,":%02X%04X%02X",n,addr,type);
+    while (n--)
+    {
+        fprintf(f,"%02X",*d);
+        sum += *d++;
+    }
+    fprintf(f,"%02X\n",(BYTE)-sum);
+}
+
+// n Bytes at addr as Intel HEX data records, 16 per line
+static void hexdata(FILE *f, ULONG addr, const BYTE *d, unsigned n)
+{
+    BYTE k;
+
+    for (; n; n-=k, addr+=k, d+=k)
+    {
+        k = n < 16 ? n : 16;
+        if ((addr>>16) != Hexbase) // extended linear address
+        {
+            BYTE b[2] = { addr>>24, addr>>16 };
+
+            Hexbase = addr>>16;
+            hexrec(f,4,0,b,2);
+        }
+        if ((addr & 0xffff) + k > 0x10000) k = 0x10000 - (addr & 0xffff);
+        hexrec(f,0,addr,d,k);
+    }
+}
+
+static int hexval(const char *p, int n)
+{
+    char b[9];
+
+    memcpy(b,p,n);
+    b[n] = 0;
+    return strtoul(b,0,16);
+}
+
+// copy the records of the firmware without its end record. returns 0=OK, 1=error (printed)
+static int merge(FILE *o, const char *fn)
+{
+    FILE *f = fopen(fn,"r");
+    char line[600];
+    ULONG base = 0, a;
+    int n, i, ln = 0;
+    BYTE sum, type;
+
+    if (!f)
+    {
+        perror(fn);
+        return 1;
+    }
+    while (fgets(line,sizeof(line),f))
+    {
+        ln++;
+        if (line[0] != ':') continue;
+        n = hexval(line+1,2);
+        for (sum=0, i=0; i<n+5; i++) sum += hexval(line+1+2*i,2);
+        if (strlen(line) < (size_t)(11+2*n) || sum)
+        {
+            fprintf(stderr,"%s:%d: bad Intel HEX record\n",fn,ln);
+            fclose(f);
+            return 1;
+        }
+        type = hexval(line+7,2);
+        a = base + hexval(line+3,4);
+        if (type == 1) break; // end of file
+        if (type == 2) base = (ULONG)hexval(line+9,4) << 4;
+        if (type == 4) base = (ULONG)hexval(line+9,4) << 16;
+        if (type == 0 && a < (ULONG)(MAXPAGE+1)*SPM_PAGESIZE && a+n > (ULONG)MINPAGE*SPM_PAGESIZE)
+        {
+            if (a < (ULONG)MINPAGE*SPM_PAGESIZE) a = (ULONG)MINPAGE*SPM_PAGESIZE;
+            fprintf(stderr,"%s:%d: the firmware reaches into the table at 0x%04lx (page %u), move TABSTART up (fewer TABPAGES) in the Makefile\n",
+                    fn,ln,(unsigned long)a,(unsigned)(a/SPM_PAGESIZE));
+            fclose(f);
+            return 1;
+        }
+        fputs(line,o);
+    }
+    fclose(f);
+    Hexbase = base >> 16;
+    if (base & 0xffff) Hexbase = ~0u; // a segment address, hexdata() sets a linear one
+    return 0;
+}
+
+// power on with the image and eeprom, look up every source. returns the number of failed lookups
+static int check(const BYTE *img, const BYTE *ee)
+{
+    WORD i;
+    int bad = 0, timings = 0, profs = 0;
+    unsigned long reads = 0, dir = 0, hits = 0;
+
+    sim_reset();
+    for (i=0; i<EEBYTES; i++) hal_ee_write(i,ee[i]);
+    Hal.ee_writes = 0;
+    sim_table_load(img);
+    if (Hal.ee_writes)
+    {
+        fprintf(stderr,"the directory was rebuilt at power on\n");
+        bad++;
+    }
+    for (i=0; i<Nmap; i++)
+    {
+        uint32_t r = Hal.flash_reads, d = Hal.ee_reads;
+
+        CS.comparecode = Map[i].r[0].comparecode;
+        if (findcode() || Tr.sendcode != Map[i].r[0].sendcode)
+        {
+            fprintf(stderr,"%s:%d: source 0x%08lx not found\n",Fn,Map[i].line,(unsigned long)CS.comparecode);
+            bad++;
+        }
+        reads += (Hal.flash_reads - r) * Map[i].hits;
+        dir += (Hal.ee_reads - d - 1) / 2 * Map[i].hits; // EE_PROBE and 2 Bytes per entry
+        hits += Map[i].hits;
+    }
+    for (i=0; i<TIMINGS; i++) timings += Timings[i].bits != 0xff;
+#ifdef RXPROF
+    for (i=0; i<NPROF; i++) profs += Prof[i].bits != 0xff;
+#endif
+    fprintf(stderr,"%d mappings in %u of %u slots, %d timings, %d receive profiles\n",Nmap,used(),(unsigned)RECORDS,timings,profs);
+    if (hits) fprintf(stderr,"per key press: %.2f pages and %.1f directory entries read\n",(double)reads/hits,(double)dir/hits);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    const char *out = 0, *firmware = 0, *bin = 0, *eep = 0;
+    static BYTE img[IMAGE], ee[EEBYTES];
+    FILE *f, *o = stdout;
+    WORD i;
+
+    while (argc>2 && argv[1][0]=='-' && argv[1][1])
+    {
+        if (!strcmp(argv[1],"-o")) out = argv[2];
+        else if (!strcmp(argv[1],"-f")) firmware = argv[2];
+        else if (!strcmp(argv[1],"-b")) bin = argv[2];
+        else if (!strcmp(argv[1],"-E")) eep = argv[2];
+        else break;
+        argc -= 2; argv += 2;
+    }
+    if (argc!=2 || (argv[1][0]=='-' && argv[1][1]))
+    {
+        fprintf(stderr,"usage: irtcomp [-o file] [-f firmware.hex] [-b file] [-E file] mapfile\n");
+        return 2;
+    }
+    Fn = argv[1];
+    if (!(f = strcmp(Fn,"-") ? fopen(Fn,"r") : stdin))
+    {
+        perror(Fn);
+        return 2;
+    }
+
+    sim_reset(); // empty table and eeprom
+    if (readmap(f) || build()) return 1;
+    for (i=MINPAGE; i<=MAXPAGE; i++) memcpy(img + (i-MINPAGE)*SPM_PAGESIZE, hal_flash_page(i), SPM_PAGESIZE);
+    for (i=0; i<EEBYTES; i++) ee[i] = hal_ee_read(i);
+    if (check(img,ee)) return 1;
+
+    if (out && !(o = fopen(out,"w")))
+    {
+        perror(out);
+        return 2;
+    }
+    if (firmware && merge(o,firmware)) return 1;
+    hexdata(o,(ULONG)MINPAGE*SPM_PAGESIZE,img,IMAGE);
+    hexrec(o,1,0,0,0);
+    if (out && fclose(o))
+    {
+        perror(out);
+        return 2;
+    }
+
+    if (bin && (!(f = fopen(bin,"wb")) || fwrite(img,IMAGE,1,f) != 1 || fclose(f)))
+    {
+        perror(bin);
+        return 2;
+    }
+    if (eep)
+    {
+        if (!(f = fopen(eep,"w")))
+        {
+            perror(eep);
+            return 2;
+        }
+        Hexbase = 0;
+        hexdata(f,0,ee,EEBYTES);
+        hexrec(f,1,0,0,0);
+        fclose(f);
+    }
+    return 0;
+}
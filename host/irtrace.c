@@ -0,0 +1,143 @@
+/*
+ AVR IR Blaster. irtrace: decode the binary trace of a DBPRINT build (see trbegin() in IRblaster.c).
+
+ usage: irtrace [-c] [file]       (no file or - = stdin, a tty is set to 9600 8N1 raw)
+   -c  write the decoded frames in the corpus format of host/irbench instead of the log
+
+ Log, one line per record, times in us from the Timer1 stamps of the firmware:
+   frame  <eot> code 0x.. s1 s2 stoplen timshort timlong cod bits, decode <us> [err repeat raw learn nodur] [lost n]
+          <durations in 40us units, none with nodur>
+   lookup found|missing|full rec <n> [cache] lookup <us> [tx <us>] [repeat] [lost n]
+ Bytes outside of records (text of the profiler) are copied to the log.
+*/
+
+#include "IRblaster.h"
+#include <unistd.h>
+#include <termios.h>
+
+static BYTE Corpus;
+static WORD Tdec; // decode stamp of the last frame, the lookup follows it
+static unsigned Bad;
+
+
+static void frame(const BYTE *p, BYTE len)
+{
+    struct trframe t;
+    BYTE n = len - sizeof(t);
+    BYTE i;
+
+    memcpy(&t,p,sizeof(t));
+    p += sizeof(t);
+    Tdec = t.tdec;
+    if (Corpus)
+    {
+        if (t.flags & (TF_ERR|TF_REPEAT|TF_NODUR)) return;
+        printf("\n\nCapcnt:%u Code:0x%08lx s1:%u s2:%u ",n+1,(unsigned long)t.code,t.timing.sync1,t.timing.sync2);
+        printf("stoplen:%u timshort:%u timlong:%u cod:%u bits:%u\n 0",t.timing.stoplen,t.timing.timshort,
+               t.timing.timlong,t.timing.coding,t.timing.bits);
+        for (i=0; i<n; i++) printf(" %u",p[i]);
+        return;
+    }
+    printf("frame  %5u code 0x%08lx s1:%u s2:%u stoplen:%u timshort:%u timlong:%u cod:%u bits:%u, decode %u",
+           t.teot,(unsigned long)t.code,t.timing.sync1,t.timing.sync2,t.timing.stoplen,t.timing.timshort,
+           t.timing.timlong,t.timing.coding,t.timing.bits,(WORD)(t.tdec - t.teot));
+    if (t.flags & TF_ERR) printf(" err");
+    if (t.flags & TF_REPEAT) printf(" repeat");
+    if (t.flags & TF_RAW) printf(" raw");
+    if (t.flags & TF_LEARN) printf(" learn");
+    if (t.flags & TF_NODUR) printf(" nodur");
+    if (t.lost) printf(" lost %u",t.lost);
+    printf("\n      ");
+    for (i=0; i<n; i++) printf(" %u",p[i]);
+    printf("\n");
+}
+
+static void lookup(const BYTE *p)
+{
+    static const char *found[] = { "found", "missing", "full" };
+    struct trlookup t;
+
+    if (Corpus) return;
+    memcpy(&t,p,sizeof(t));
+    printf("lookup %s rec %u%s lookup %u",t.found < 3 ? found[t.found] : "?",t.rec,
+           (t.flags & TL_CACHE) ? " cache" : "",(WORD)(t.tfind - Tdec));
+    if (t.flags & TL_TX) printf(" tx %u",(WORD)(t.ttx - t.tfind));
+    if (t.flags & TL_REPEAT) printf(" repeat");
+    if (t.lost) printf(" lost %u",t.lost);
+    printf("\n");
+}
+
+// read a record behind TR_SYNC. returns 0 at the end of the input
+static int record(FILE *f)
+{
+    BYTE buf[256];
+    int type, len, c, i;
+    BYTE sum;
+
+    if ((type = getc(f)) == EOF || (len = getc(f)) == EOF) return 0;
+    sum = type + len;
+    for (i=0; i<len; i++)
+    {
+        if ((c = getc(f)) == EOF) return 0;
+        sum += buf[i] = c;
+    }
+    if ((c = getc(f)) == EOF) return 0;
+    if (c != sum || (type == TR_FRAME && len < (int)sizeof(struct trframe)) ||
+        (type == TR_LOOKUP && len != (int)sizeof(struct trlookup)) || (type != TR_FRAME && type != TR_LOOKUP))
+    {
+        Bad++;
+        if (!Corpus) printf("bad record\n");
+        return 1;
+    }
+    if (type == TR_FRAME) frame(buf,len);
+    else lookup(buf);
+    return 1;
+}
+
+// a serial port: 9600 8N1, no line discipline
+static void rawtty(int fd)
+{
+    struct termios t;
+
+    if (tcgetattr(fd,&t)) return;
+    cfmakeraw(&t);
+    cfsetispeed(&t,B9600);
+    cfsetospeed(&t,B9600);
+    tcsetattr(fd,TCSANOW,&t);
+}
+
+int main(int argc, char **argv)
+{
+    FILE *f = stdin;
+    int c;
+
+    if (argc>1 && !strcmp(argv[1],"-c"))
+    {
+        Corpus = 1;
+        argc--; argv++;
+    }
+    if (argc>2 || (argc==2 && argv[1][0]=='-' && argv[1][1]))
+    {
+        fprintf(stderr,"usage: irtrace [-c] [file]\n");
+        return 2;
+    }
+    if (argc==2 && strcmp(argv[1],"-") && !(f = fopen(argv[1],"rb")))
+    {
+        perror(argv[1]);
+        return 2;
+    }
+    if (isatty(fileno(f))) rawtty(fileno(f));
+    setvbuf(stdout,0,_IOLBF,0); // follow a live port
+
+    while ((c = getc(f)) != EOF)
+    {
+        if (c == TR_SYNC)
+        {
+            if (!record(f)) break;
+        }
+        else if (!Corpus) putchar(c); // profiler text
+    }
+    if (Corpus) printf("\n");
+    if (Bad) fprintf(stderr,"%u bad records\n",Bad);
+    return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ AVR IR Blaster. Event-driven timer/ISR simulator for the hosted build, see sim.h.
+
+ Timer models:
+ - Timer1: free running 1Mhz, TCNT1 = time modulo 65536.
+ - Timer1 capture: ICR1 = TCNT1 at the edge. An edge is captured if the capture interrupt is enabled
+   and it matches the edge select (falling = start of a Mark, the receiver inverts).
+ - Timer1 compare A: match when TCNT1 reaches OCR1A, 65536us later if OCR1A is not moved.
+ - Timer2: 128us per tick, overflows (256-TCNT2) ticks after the capture isr preset it.
+   A frame ends by the overflow, or in the capture isr if it matches a receive profile.
+ - Timer1 compare B: the UI tick, like compare A.
+ - Learn button: pressing it fires INT1_vect if enabled, the tick isr samples the level.
+ - Uart receive: every Byte fires USART_RX_vect, also in power-down (the wakeup by RXD is not modelled).
+ - Sleep: after every interrupt the main loop runs service(), then deepsleep() decides about power-down.
+   In power-down no timer runs. An input edge starts the oscillator, PCINT0_vect fires Sim.wakeup us later
+   (SIM_WAKEUP), edges meanwhile are lost. PCINT0_vect takes the level then as the first capture.
+ - Uart (DBPRINT): the data register empty interrupt sends a Byte of the trace every SIM_UARTBYTE us.
+ - Echo (optional): every Mark/Space switch of the transmitter reaches the receiver Sim.echo us later.
+   The receiver sees a Mark if the remote or the echo sends one.
+ */
+
+#include "sim.h"
+
+struct sim Sim;
+
+void TIMER1_CAPT_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER2_OVF_vect(void);
+void TIMER1_COMPB_vect(void);
+void INT1_vect(void);
+void PCINT0_vect(void);
+#ifdef DBPRINT
+void USART_UDRE_vect(void);
+#else
+static void USART_UDRE_vect(void) {} // no trace, its interrupt is never enabled
+#endif
+#if defined(PROFILE) || defined(PROVISION)
+void USART_RX_vect(void);
+#else
+static void USART_RX_vect(void) {} // nothing listens on the uart
+#endif
+
+#define T2TICK 128 // us per Timer2 tick at 8Mhz/1024
+
+
+void sim_reset(void)
+{
+    memset(&Sim,0,sizeof(Sim));
+    Sim.wakeup = SIM_WAKEUP;
+    hal_init();
+    sim_poweron();
+}
+
+// the time and the statistics go on, the frame being received and the echo are lost
+void sim_poweron(void)
+{
+    if (Hal.wake) Sim.down += Sim.now - Sim.downstart;
+    Sim.inframe = Sim.echomark = Sim.necho = Sim.waking = 0;
+    Sim.mark = Sim.remote;
+    hal_poweron();
+    Hal.rxmark = Sim.mark;
+    Page = 0;
+    Capcnt=Errors=Noise=Learnbut=Gotcode=Debug=0;
+    memset(Rejects,0,sizeof(Rejects));
+    Rxhead=Rxtail=Rxframes=Txbusy=Txcnt=Txon=Txwait=Txrep=Job=0;
+    PCS=0;
+    Repsync1=Repsync2=0;
+    Learnstate=Blinks=Butcnt=Butlevel=Butdown=0;
+    clearcache();
+    checkdir();
+    loadprofiles();
+    set_receiver();
+    sei();
+    if (deepsleep()) Sim.downstart = Sim.now;
+}
+
+BYTE sim_table_add(const struct ircode *r)
+{
+    CS = *r;
+    if (makeroom(1)) return 1; // the tablespace is full
+    if (findcode()==2) return 1;
+    return storecode();
+}
+
+void sim_table_load(const BYTE *img)
+{
+    BYTE p;
+
+    for (p=MINPAGE; p<=MAXPAGE; p++) memcpy(hal_flash_page(p), img + (p-MINPAGE)*SPM_PAGESIZE, SPM_PAGESIZE);
+    Page = 0;
+    clearcache();
+    Repsync1 = 0;
+    checkdir(); // like main() at power on
+    loadprofiles();
+}
+
+// record what the isr or the main loop did to the transmitter since the snapshot in compare/starts
+static void txcheck(BYTE compare, uint32_t starts)
+{
+    if (compare && !Hal.compare) // transmission terminated
+    {
+        if (Sim.tx.nedges & 1) Sim.tx.end = Sim.now; // ended in a Mark
+        if (Sim.done) Sim.done(&Sim.tx);
+        compare = 0;
+    }
+
+    if (Hal.t1starts != starts) // set_transmitter()
+    {
+        if (!compare) // start of a translation
+        {
+            Sim.translated++;
+            memset(&Sim.tx,0,sizeof(Sim.tx));
+            Sim.tx.code = CS.comparecode;
+            Sim.tx.start = Sim.start;
+            Sim.tx.lastedge = Sim.lastedge;
+            Sim.tx.eot = Sim.now;
+        }
+    }
+}
+
+// call an isr and record what it did to the peripherals
+static void fire(void (*isr)(void))
+{
+    BYTE ir = Hal.ir;
+    BYTE compare = Hal.compare;
+    uint32_t starts = Hal.t1starts;
+    BYTE wake = Hal.wake;
+
+    Hal.tcnt1 = Sim.now;
+    isr();
+    if (wake && !Hal.wake) // woke up from power-down
+    {
+        Sim.down += Sim.now - Sim.downstart;
+        Sim.wakes++;
+    }
+
+    if (Hal.ir != ir) // Mark/Space switched
+    {
+        if (Hal.ir && Txcnt == 1) Sim.tx.records++; // the first Mark of a record
+        if (Sim.tx.nedges < SIM_TXEDGES)
+        {
+            if (Hal.ir && !Sim.tx.nedges) Sim.tx.firstmark = Sim.now;
+            if (!Hal.ir) Sim.tx.end = Sim.now;
+            Sim.tx.edge[Sim.tx.nedges++] = Sim.now;
+        }
+        if (Sim.echo && Sim.necho < SIM_ECHOQ)
+        {
+            BYTE i = (Sim.echohead + Sim.necho++) % SIM_ECHOQ;
+            Sim.echot[i] = Sim.now + Sim.echo;
+            Sim.echolevel[i] = Hal.ir;
+        }
+    }
+    txcheck(compare,starts);
+
+    compare = Hal.compare;
+    starts = Hal.t1starts;
+    service(); // the main loop runs after every interrupt, it may start the next translation
+    txcheck(compare,starts);
+    if (!Hal.wake && !Job && deepsleep()) Sim.downstart = Sim.now; // back to power-down
+
+    if (Hal.compare) // next match when TCNT1 reaches OCR1A
+    {
+        uint16_t d = Hal.ocr - (uint16_t)Sim.now;
+        Sim.t1due = Sim.now + (d ? d : 65536);
+    }
+    if (Hal.tick) // compare B
+    {
+        uint16_t d = Hal.ocrb - (uint16_t)Sim.now;
+        Sim.tickdue = Sim.now + (d ? d : 65536);
+    }
+    if (isr == USART_UDRE_vect) Sim.uartdue = Sim.now + SIM_UARTBYTE; // a Byte went out, or the last one still does
+    else if (Hal.udrie && (int32_t)(Sim.uartdue - Sim.now) < 0) Sim.uartdue = Sim.now; // fires at once when idle
+}
+
+// the cpu runs again after the start-up from power-down: PCINT0_vect takes a Mark as the first capture
+static void wake(void)
+{
+    Sim.waking = 0;
+    fire(PCINT0_vect);
+    if (Hal.timeout) Sim.t2due = Sim.now + (256 - Hal.tcnt2) * T2TICK;
+}
+
+// the level at the receiver input changes to the remote OR the echo level
+static void input(uint32_t t, BYTE remote)
+{
+    BYTE mark = Sim.mark;
+
+    Sim.mark = Sim.remote | Sim.echomark;
+    if (Sim.mark == mark) return; // covered by the other source
+    Hal.rxmark = Sim.mark;
+
+    if (!Hal.wake) // in power-down every pin change wakes the cpu
+    {
+        if (!Hal.capture)
+        {
+            if (remote) Sim.lost++;
+            return;
+        }
+        if (Sim.mark == Hal.capedge) return; // edge select does not match: falling (0) captures the start of a Mark
+    }
+
+    if (remote && (!Hal.wake || Sim.mark))
+    {
+        if (!Sim.inframe)
+        {
+            Sim.inframe = 1;
+            Sim.start = t;
+        }
+        Sim.lastedge = t;
+    }
+    if (Hal.wake) // the pin change wakes the cpu after the start-up of the oscillator
+    {
+        if (Sim.waking)
+        {
+            if (remote) Sim.lost++; // the cpu does not run yet
+            return;
+        }
+        Sim.waking = 1;
+        Sim.wakedue = t + Sim.wakeup;
+        if (!Sim.wakeup) wake();
+        return;
+    }
+    Hal.icr = t;
+    fire(TIMER1_CAPT_vect);
+    Sim.t2due = t + (256 - Hal.tcnt2) * T2TICK;
+    if (!Hal.timeout) // the capture isr ended the frame by its profile
+    {
+        Sim.frames++;
+        Sim.inframe = 0;
+    }
+}
+
+void sim_run(uint32_t t)
+{
+    while (1)
+    {
+        uint32_t due = t;
+        BYTE ev = 0;
+
+        if (Hal.compare && (int32_t)(Sim.t1due - due) <= 0)
+        {
+            due = Sim.t1due;
+            ev = 1;
+        }
+        if (Hal.timeout && (int32_t)(Sim.t2due - due) < (ev ? 0 : 1)) // the earlier one, Timer1 first if equal
+        {
+            due = Sim.t2due;
+            ev = 2;
+        }
+        if (Sim.necho && (int32_t)(Sim.echot[Sim.echohead] - due) < (ev ? 0 : 1))
+        {
+            due = Sim.echot[Sim.echohead];
+            ev = 3;
+        }
+        if (Hal.tick && (int32_t)(Sim.tickdue - due) < (ev ? 0 : 1))
+        {
+            due = Sim.tickdue;
+            ev = 4;
+        }
+        if (Hal.udrie && (int32_t)(Sim.uartdue - due) < (ev ? 0 : 1))
+        {
+            due = Sim.uartdue;
+            ev = 5;
+        }
+        if (Sim.waking && (int32_t)(Sim.wakedue - due) < (ev ? 0 : 1))
+        {
+            due = Sim.wakedue;
+            ev = 6;
+        }
+        if (!ev) break;
+
+        Sim.now = due;
+        if (ev == 1)
+            fire(TIMER1_COMPA_vect);
+        else if (ev == 2)
+        {
+            if (!Noise) Sim.frames++; // not the end of a rejected burst
+            Sim.inframe = 0;
+            fire(TIMER2_OVF_vect);
+            if (Hal.timeout) Sim.t2due += 256*T2TICK; // not stopped, Timer2 wraps around
+        }
+        else if (ev == 4)
+            fire(TIMER1_COMPB_vect);
+        else if (ev == 5)
+            fire(USART_UDRE_vect);
+        else if (ev == 6)
+            wake();
+        else
+        {
+            Sim.echomark = Sim.echolevel[Sim.echohead];
+            Sim.echohead = (Sim.echohead+1) % SIM_ECHOQ;
+            Sim.necho--;
+            input(due,0);
+        }
+    }
+    Sim.now = t;
+}
+
+void sim_edge(uint32_t t)
+{
+    sim_run(t);
+    Sim.remote ^= 1;
+    input(t,1);
+}
+
+void sim_button(uint32_t t, BYTE pressed)
+{
+    sim_run(t);
+    Hal.button = pressed;
+    if (pressed && Hal.buttonint) fire(INT1_vect);
+}
+
+void sim_uart(uint32_t t, BYTE c)
+{
+    sim_run(t);
+    Hal.uart_rx = c;
+    fire(USART_RX_vect);
+}
+
+void sim_idle(void)
+{
+    while (Hal.timeout || Hal.compare || Sim.necho || Hal.udrie || Sim.waking || (Hal.tick && !Learnbut))
+        sim_run(Sim.now + 1000);
+}
@@ -0,0 +1,81 @@
+/*
+ AVR IR Blaster. Event-driven timer/ISR simulator for the hosted build.
+
+ Time is counted in us, the Timer1 clock. The simulator feeds IR edges into TIMER1_CAPT_vect,
+ fires TIMER2_OVF_vect when the receive timeout expires and TIMER1_COMPA_vect when the
+ transmit period programmed in OCR1A expires. The ISRs themselves take no time.
+ The emitted waveform is recorded from the Mark/Space switching (COM0A0) of the transmitter.
+ The receiver stays armed while transmitting, the waveform can be fed back to it as echo.
+
+ A translation starts when doframe() starts the transmitter and ends when the compare interrupt
+ is switched off. It may contain several records (multi-record chains).
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include "IRblaster.h"
+
+#define SIM_TXEDGES 1024 // recorded transmitter edges per translation
+#define SIM_ECHOQ 8 // echo edges on their way to the receiver
+#define SIM_UARTBYTE 1042 // us per Byte at 9600 Baud 8N1
+// us from a pin change in power-down to PCINT0_vect: internal RC oscillator (CKSEL 0010) 6 CK start-up from
+// power-down for every SUT (the 65ms of SUT=10 delay only the reset), 4 CK halt and 4 CK interrupt response at 8Mhz
+#define SIM_WAKEUP 2
+
+struct simtx // one completed translation
+{
+    ULONG code;        // received comparecode that was translated
+    BYTE records;      // number of transmitted records, repeats included
+    uint32_t start;    // first edge of the received frame
+    uint32_t lastedge; // last edge of the received frame
+    uint32_t eot;      // end of the frame, start of the transmitter (gap before the first record)
+    uint32_t firstmark;// start of the first transmitted mark
+    uint32_t end;      // end of the last transmitted mark
+    uint16_t nedges;   // transmitter edges in edge[], even index = mark start, odd = mark end
+    uint32_t edge[SIM_TXEDGES];
+};
+
+struct sim
+{
+    uint32_t now;       // current time in us
+    BYTE mark;          // level of the IR input, 1 = Mark received
+    BYTE remote;        // level sent by the remote
+    BYTE echomark;      // level of the echo of our own transmitter
+    uint32_t echo;      // delay of the echo in us, 0 = no echo
+    BYTE echohead, necho;
+    uint32_t echot[SIM_ECHOQ];
+    BYTE echolevel[SIM_ECHOQ];
+    BYTE inframe;       // a frame is being received
+    uint32_t start;     // first edge of the current frame
+    uint32_t lastedge;  // last captured edge
+    uint32_t t1due;     // next Timer1 compare match
+    uint32_t t2due;     // next Timer2 overflow
+    uint32_t tickdue;   // next UI tick (Timer1 compare B)
+    uint32_t uartdue;   // the uart data register is empty again
+    uint32_t frames;    // received frames ended by a timeout or early by a profile
+    uint32_t translated;// frames that started a transmission
+    uint32_t lost;      // remote edges that arrived while capture was off
+    uint32_t down;      // time in power-down, until downstart if still sleeping
+    uint32_t downstart; // start of the current power-down
+    uint32_t wakes;     // wakeups from power-down
+    uint32_t wakeup;    // start-up time from power-down in us, SIM_WAKEUP
+    BYTE waking;        // a pin change woke the cpu, PCINT0_vect fires at wakedue
+    uint32_t wakedue;
+    struct simtx tx;    // translation in progress or last completed
+    void (*done)(const struct simtx *t); // called for every completed translation, may be 0
+};
+
+extern struct sim Sim;
+
+void sim_reset(void); // power on: empty flash table, receiver armed, time 0, no echo
+void sim_poweron(void); // power on again with the flash and eeprom as they are, a power loss (Hal.powercut) ends
+BYTE sim_table_add(const struct ircode *r); // append a record like learncode() does. returns 0=OK, 1=table or timing dictionary full
+void sim_table_load(const BYTE *img); // flash the code table image (pages MINPAGE..MAXPAGE) and power on again, the eeprom is kept
+void sim_run(uint32_t t); // advance the time to t and fire all timer events until then
+void sim_edge(uint32_t t); // IR input edge at time t, toggles between Mark and Space
+void sim_button(uint32_t t, BYTE pressed); // learn button pressed (1) or released (0) at time t
+void sim_uart(uint32_t t, BYTE c); // Byte c received on the uart at time t
+void sim_idle(void); // run until all timers are idle and the receiver is armed. the LED prompts of the learn menu run forever
+
+#endif
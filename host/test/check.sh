@@ -0,0 +1,15 @@
+#!/bin/sh
+# Replay a trace of host/test with host/irsim (make host first), more arguments are irsim options.
+# Its report must contain the text of every "#= " comment line of the trace.
+# A "#! " comment line gives more irsim options for the trace.
+t=$1
+shift
+out=`host/irsim \`sed -n 's/^#! //p' $t\` "$@" $t 2>&1` || { echo "$t: irsim failed"; echo "$out"; exit 1; }
+sed -n 's/^#= //p' $t | {
+    bad=0
+    while IFS= read -r want; do
+        echo "$out" | grep -F -q -- "$want" || { echo "$t: expected \"$want\""; bad=1; }
+    done
+    exit $bad
+} || { echo "$out"; exit 1; }
+echo "$t: ok"
@@ -0,0 +1,10 @@
+#!/bin/sh
+# Provisioning round trip: compile host/test/provision.map with host/irtcomp, upload the image to an emulated
+# blaster over the serial protocol and dump it back, it must be the same. Then the blaster translates the key
+# presses of host/test/provision.keys with the dumped table.
+d=`mktemp -d` || exit 1
+trap 'rm -rf $d' EXIT
+host/irtcomp -b $d/image host/test/provision.map >/dev/null 2>&1 || { echo "provision: irtcomp failed"; exit 1; }
+host/irtable -e upload $d/image verify $d/image dump $d/dump >/dev/null || { echo "provision: irtable failed"; exit 1; }
+cmp $d/image $d/dump || { echo "provision: the dump differs from the upload"; exit 1; }
+sh host/test/check.sh host/test/provision.keys -l $d/dump